@@ -114,6 +114,7 @@ public:
 struct AOVData {
 public:
     std::vector<AtRGBA> buffer;
+    std::vector<AtRGBA> gather_buffer; // dim samples, blurred into buffer by the imager
     TokenizedOutputLentil to;
 
     AtString name = AtString("");
@@ -158,6 +159,7 @@ private:
 
     void destroy_buffers() {
         buffer.clear();
+        gather_buffer.clear();
         crypto_hash_map.clear();
         crypto_total_weight.clear();
     }
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+
+// Precomputed "valid aperture" atlas for the polynomial optics camera.
+// The sensor is divided in a grid of cells. For every cell, the primary sample square (r1, r2) that drives
+// the aperture sampling is divided in bins, and only the bins that transmit through the lens at one of the
+// cell corners are kept, dilated by one bin and one cell. Drawing aperture samples from the kept bins removes most
+// of the vignetting retries. The samples keep weight 1 and still go through the exact transmission test, the atlas
+// only narrows the proposal. It is built from point samples, so it is close to conservative but can't guarantee it.
+// Only valid for aperture mappings that preserve area and locality (disk, blades), not for the bokeh image cdf.
+class ApertureAtlas {
+public:
+    static const int cells = 8; // sensor cells per axis
+    static const int bins = 16; // primary sample bins per axis
+
+    ApertureAtlas() : extent_x(1.0), extent_y(1.0), built(false) {}
+
+    bool is_built_for(const std::vector<double> &settings_in) const {
+        return built && settings == settings_in;
+    }
+
+    void invalidate() {
+        built = false;
+        settings.clear();
+        valid_bins.clear();
+    }
+
+    // transmits(sx, sy, r1, r2) returns true when the ray from screen space sensor position (sx, sy)
+    // through the aperture sample generated by (r1, r2) makes it through the lens
+    template<typename TransmitFn>
+    void build(const std::vector<double> &settings_in, const double extent_x_in, const double extent_y_in, TransmitFn transmits) {
+        invalidate();
+        extent_x = extent_x_in;
+        extent_y = extent_y_in;
+
+        const int vertices = cells + 1;
+        const int corners = bins + 1;
+        std::vector<std::vector<char>> corner_mask(vertices*vertices, std::vector<char>(corners*corners, 0));
+        std::vector<std::vector<char>> center_mask(vertices*vertices, std::vector<char>(bins*bins, 0));
+
+        for (int vy = 0; vy < vertices; ++vy){
+            for (int vx = 0; vx < vertices; ++vx){
+                const int v = vy*vertices + vx;
+                const double sx = linear(vx, extent_x);
+                const double sy = linear(vy, extent_y);
+
+                for (int j = 0; j < corners; ++j){
+                    for (int i = 0; i < corners; ++i){
+                        // stay just inside of the unit square, some mappings are degenerate at exactly 0 and 1
+                        const double r1 = std::min(std::max(double(i)/bins, 1e-4), 1.0 - 1e-4);
+                        const double r2 = std::min(std::max(double(j)/bins, 1e-4), 1.0 - 1e-4);
+                        corner_mask[v][j*corners + i] = transmits(sx, sy, r1, r2);
+                    }
+                }
+
+                for (int j = 0; j < bins; ++j){
+                    for (int i = 0; i < bins; ++i){
+                        center_mask[v][j*bins + i] = transmits(sx, sy, (i + 0.5)/bins, (j + 0.5)/bins);
+                    }
+                }
+            }
+        }
+
+        // a bin is kept for a cell when it (partially) transmits at any of the four cell corners
+        std::vector<std::vector<char>> kept(cells*cells, std::vector<char>(bins*bins, 0));
+        for (int cy = 0; cy < cells; ++cy){
+            for (int cx = 0; cx < cells; ++cx){
+                for (int j = 0; j < bins; ++j){
+                    for (int i = 0; i < bins; ++i){
+                        bool valid = false;
+                        for (int c = 0; c < 4 && !valid; ++c){
+                            const int v = (cy + c/2)*vertices + (cx + c%2);
+                            valid = center_mask[v][j*bins + i] ||
+                                    corner_mask[v][j*corners + i] || corner_mask[v][j*corners + i+1] ||
+                                    corner_mask[v][(j+1)*corners + i] || corner_mask[v][(j+1)*corners + i+1];
+                        }
+                        kept[cy*cells + cx][j*bins + i] = valid;
+                    }
+                }
+            }
+        }
+
+        // the corners and centres are only point samples, a thin transmitting sliver can fall in between them.
+        // dilating by one bin and one neighbouring cell covers what the point samples miss, unless the vignetting
+        // changes faster than the grid resolves. The exact test after sampling stays for that reason.
+        valid_bins.resize(cells*cells);
+        for (int cy = 0; cy < cells; ++cy){
+            for (int cx = 0; cx < cells; ++cx){
+                std::vector<int> &cell_bins = valid_bins[cy*cells + cx];
+                for (int j = 0; j < bins; ++j){
+                    for (int i = 0; i < bins; ++i){
+                        if (kept_near(kept, cx, cy, i, j)) cell_bins.push_back(j*bins + i);
+                    }
+                }
+            }
+        }
+
+        settings = settings_in;
+        built = true;
+    }
+
+    // remaps (r1, r2) to the transmitting part of the primary sample square at screen space position (sx, sy).
+    // returns false when nothing transmits in this cell, in which case r1, r2 are untouched.
+    inline bool sample(const double sx, const double sy, double &r1, double &r2) const {
+        double u = 0.0, v = 0.0;
+        int cx = 0, cy = 0;
+        to_cell(sx, extent_x, cx, u);
+        to_cell(sy, extent_y, cy, v);
+
+        const std::vector<int> &cell_bins = valid_bins[cy*cells + cx];
+        if (cell_bins.empty()) return false;
+
+        // pick a bin with r1, reuse what's left of r1 as the offset within the bin
+        const double scaled = r1 * cell_bins.size();
+        const int k = std::min(static_cast<int>(scaled), static_cast<int>(cell_bins.size()) - 1);
+        const int bin = cell_bins[k];
+        r1 = ((bin % bins) + (scaled - k)) / bins;
+        r2 = ((bin / bins) + r2) / bins;
+
+        return true;
+    }
+
+private:
+    double extent_x;
+    double extent_y;
+    bool built;
+    std::vector<double> settings;
+    std::vector<std::vector<int>> valid_bins; // per cell
+
+    static bool kept_near(const std::vector<std::vector<char>> &kept, const int cx, const int cy, const int i, const int j) {
+        for (int ny = std::max(cy - 1, 0); ny <= std::min(cy + 1, cells - 1); ++ny){
+            for (int nx = std::max(cx - 1, 0); nx <= std::min(cx + 1, cells - 1); ++nx){
+                for (int bj = std::max(j - 1, 0); bj <= std::min(j + 1, bins - 1); ++bj){
+                    for (int bi = std::max(i - 1, 0); bi <= std::min(i + 1, bins - 1); ++bi){
+                        if (kept[ny*cells + nx][bj*bins + bi]) return true;
+                    }
+                }
+            }
+        }
+        return false;
+    }
+
+    static inline double linear(const int i, const double extent) {
+        return -extent + 2.0 * extent * double(i) / double(cells);
+    }
+
+    static inline void to_cell(const double s, const double extent, int &cell, double &t) {
+        double pos = (s + extent) / (2.0 * extent) * cells;
+        pos = std::min(std::max(pos, 0.0), cells - 1e-6);
+        cell = static_cast<int>(pos);
+        t = pos - cell;
+    }
+};
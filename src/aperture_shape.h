@@ -0,0 +1,119 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "../../Eigen/Eigen/Core"
+
+
+// aperture sampling strategy, resolved once per update for the templated ray kernels
+enum ApertureShape{
+    aperture_disk,
+    aperture_blades,
+    aperture_image
+};
+
+
+// Maps primary samples (u, v) on the unit square to points on the unit aperture.
+// Everything that is constant during a render is tabulated in setup(): the blade vertices, the sine/cosine of the
+// concentric mapping and the radial bias of the warped disc. sample() is then branch free arithmetic and table lookups,
+// so the forward camera, the filter and the polynomial optics paths all share one cheap code path.
+// The bokeh image shape is sampled by imageData instead.
+class ApertureShapeSampler {
+public:
+    static const int table_size = 1024;
+
+    ApertureShapeSampler() { setup(6, 0.5, 0.0); }
+
+    // bias warps the radius like AiBias (0.5 is uniform), squarelerp blends the disc towards the unit square
+    void setup(const int blades_in, const double bias_in, const double squarelerp_in) {
+        if (blades_in == blades && bias_in == bias && squarelerp_in == squarelerp) return;
+        blades = std::max(blades_in, 3);
+        bias = bias_in;
+        squarelerp = squarelerp_in;
+
+        // blade vertex b sits at angle 2pi/blades * b, the extra entry closes the polygon
+        blade_x.resize(blades + 1);
+        blade_y.resize(blades + 1);
+        for (int b = 0; b <= blades; ++b) {
+            blade_x[b] = std::cos(2.0*M_PI/blades * b);
+            blade_y[b] = std::sin(2.0*M_PI/blades * b);
+        }
+
+        // concentric mapping angle pi/4 * t for t in [-1, 1]
+        octant_cos.resize(table_size + 1);
+        octant_sin.resize(table_size + 1);
+        for (int i = 0; i <= table_size; ++i) {
+            const double t = 2.0 * i / table_size - 1.0;
+            octant_cos[i] = std::cos(0.78539816339 * t);
+            octant_sin[i] = std::sin(0.78539816339 * t);
+        }
+
+        // AiBias(r, bias) = r^(log(bias)/log(0.5)) for r in [0, 1]
+        const double exponent = std::log(bias) / std::log(0.5);
+        radius_bias.resize(table_size + 1);
+        for (int i = 0; i <= table_size; ++i) radius_bias[i] = std::pow(static_cast<double>(i) / table_size, exponent);
+    }
+
+    template<ApertureShape Shape>
+    inline void sample(const double u, const double v, Eigen::Vector2d &unit_disk) const {
+        static_assert(Shape != aperture_image, "the bokeh image is sampled by imageData");
+        if constexpr (Shape == aperture_blades) sample_blades(u, v, unit_disk);
+        else sample_disk(u, v, unit_disk);
+    }
+
+    inline void sample(const ApertureShape shape, const double u, const double v, Eigen::Vector2d &unit_disk) const {
+        if (shape == aperture_blades) sample_blades(u, v, unit_disk);
+        else sample_disk(u, v, unit_disk);
+    }
+
+private:
+    int blades = 0;
+    double bias = -1.0;
+    double squarelerp = -1.0;
+    std::vector<double> blade_x, blade_y;
+    std::vector<double> octant_cos, octant_sin;
+    std::vector<double> radius_bias;
+
+    static inline double lookup(const std::vector<double> &table, const double t) {
+        const double pos = std::min(std::max(t, 0.0), 1.0) * table_size;
+        const int i = std::min(static_cast<int>(pos), table_size - 1);
+        const double f = pos - i;
+        return table[i] + f * (table[i+1] - table[i]);
+    }
+
+    // uniform over the polygon: pick a triangle with u, sample it with the rest of u and v
+    inline void sample_blades(double u, const double v, Eigen::Vector2d &unit_disk) const {
+        const int tri = std::min(static_cast<int>(u * blades), blades - 1);
+        u = u * blades - tri;
+
+        const double a = std::sqrt(u);
+        const double b = (1.0 - v) * a;
+        const double c = v * a;
+
+        unit_disk(0) = b * blade_x[tri+1] + c * blade_x[tri];
+        unit_disk(1) = b * blade_y[tri+1] + c * blade_y[tri];
+    }
+
+    // concentric mapping (shirley-chiu), with the radial bias and square blend of the warped disc
+    inline void sample_disk(const double u, const double v, Eigen::Vector2d &unit_disk) const {
+        const double a = 2.0 * u - 1.0;
+        const double b = 2.0 * v - 1.0;
+
+        // the larger coordinate is the radius, the ratio of the two the angle within the octant.
+        // vertical octants are rotated by pi/2, which swaps sine and cosine
+        const bool horizontal = a*a > b*b;
+        const double r = horizontal ? a : b;
+        const double t = r != 0.0 ? (horizontal ? b : a) / r : 0.0;
+        const double c = lookup(octant_cos, 0.5 * (t + 1.0));
+        const double s = lookup(octant_sin, 0.5 * (t + 1.0));
+
+        const double r_biased = std::copysign(lookup(radius_bias, std::abs(r)), r);
+        const double x = r_biased * (horizontal ? c : s);
+        const double y = r_biased * (horizontal ? s : c);
+
+        unit_disk(0) = x + squarelerp * (a - x);
+        unit_disk(1) = y + squarelerp * (b - y);
+    }
+};
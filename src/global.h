@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstdint>
+#include <cstring>
+
 inline float linear_interpolate(float perc, float a, float b){
     return a + perc * (b - a);
 }
@@ -18,42 +21,119 @@ inline float clamp_min(float in, const float min) {
 }
 
 
-// xorshift fast random number generator
-inline uint32_t xor128(void){
-  static uint32_t x = 123456789, y = 362436069, z = 521288629, w = 88675123;
-  uint32_t t = x ^ (x << 11);
-  x = y; y = z; z = w;
-  return w = (w ^ (w >> 19) ^ t ^ (t >> 8));
+// https://www.pcg-random.org, one-shot pcg hash (PCG-RXS-M-XS 32) as in Jarzynski & Olano 2020
+inline uint32_t pcg_hash(const uint32_t value)
+{
+  const uint32_t state = value * 747796405u + 2891336453u;
+  const uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+  return (word >> 22u) ^ word;
+}
+
+
+inline uint32_t float_bits(const float value)
+{
+  uint32_t bits = 0;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return bits;
 }
 
 
-// https://github.com/nvpro-samples/optix_advanced_samples/blob/master/src/optixIntroduction/optixIntro_06/shaders/random_number_generators.h
-// Tiny Encryption Algorithm (TEA) to calculate a the seed per launch index and iteration.
-template<unsigned int N>
-inline unsigned int tea(const unsigned int val0, const unsigned int val1)
+// key of the random stream of a camera sample, from the screen and lens positions arnold generated for it
+inline uint32_t random_key(const double sx, const double sy, const double lensx, const double lensy)
 {
-  unsigned int v0 = val0;
-  unsigned int v1 = val1;
-  unsigned int s0 = 0;
-
-  for (unsigned int n = 0; n < N; ++n)
-  {
-    s0 += 0x9e3779b9;
-    v0 += ((v1 << 4) + 0xA341316C) ^ (v1 + s0) ^ ((v1 >> 5) + 0xC8013EA4);
-    v1 += ((v0 << 4) + 0xAD90777D) ^ (v0 + s0) ^ ((v0 >> 5) + 0x7E95761E);
+  uint32_t key = pcg_hash(float_bits(static_cast<float>(sx)));
+  key = pcg_hash(key ^ float_bits(static_cast<float>(sy)));
+  key = pcg_hash(key ^ float_bits(static_cast<float>(lensx)));
+  return pcg_hash(key ^ float_bits(static_cast<float>(lensy)));
+}
+
+
+// counter-based random number stream: the n-th number is a pure function of (key, n).
+// every camera ray or splat owns its stream, so nothing is shared between render threads and
+// the numbers don't depend on thread scheduling.
+struct RandomStream {
+  uint32_t key;
+  uint32_t counter;
+
+  explicit RandomStream(const uint32_t key_in) : key(pcg_hash(key_in)), counter(0) {}
+
+  inline uint32_t next_uint() { return pcg_hash(key ^ pcg_hash(counter++)); }
+
+  // [0, 1), upper 24 bits
+  inline float next() { return static_cast<float>(next_uint() >> 8) / 16777216.0f; }
+};
+
+
+// sobol direction numbers for the first 4 dimensions (Joe & Kuo), dimension 0 is van der Corput
+struct SobolDirections {
+  uint32_t v[4][32];
+
+  constexpr SobolDirections() : v() {
+    const uint32_t degree[4] = {0, 1, 2, 3};
+    const uint32_t coefficients[4] = {0, 0, 1, 1};
+    const uint32_t initial[4][3] = {{0, 0, 0}, {1, 0, 0}, {1, 3, 0}, {1, 3, 1}};
+
+    for (int k = 0; k < 32; ++k) v[0][k] = 1u << (31 - k);
+    for (int d = 1; d < 4; ++d) {
+      const uint32_t s = degree[d];
+      for (uint32_t k = 0; k < 32; ++k) {
+        if (k < s) { v[d][k] = initial[d][k] << (31 - k); continue; }
+        uint32_t value = v[d][k-s] ^ (v[d][k-s] >> s);
+        for (uint32_t j = 1; j < s; ++j) {
+          if ((coefficients[d] >> (s - 1 - j)) & 1u) value ^= v[d][k-j];
+        }
+        v[d][k] = value;
+      }
+    }
   }
-  return v0;
+};
+
+
+inline uint32_t reverse_bits(uint32_t x)
+{
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+
+// hash based owen scrambling, Burley 2020 "Practical Hash-based Owen Scrambling"
+inline uint32_t nested_uniform_scramble(uint32_t x, const uint32_t seed)
+{
+  x = reverse_bits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return reverse_bits(x);
 }
 
 
-// https://github.com/nvpro-samples/optix_advanced_samples/blob/master/src/optixIntroduction/optixIntro_06/shaders/random_number_generators.h
-// Return a random sample in the range [0, 1) with a simple Linear Congruential Generator.
-inline float rng(unsigned int& previous)
+// seed of an independent pattern derived from seed, used to pad dimensions beyond the 4 of sobol_owen()
+inline uint32_t pattern_seed(const uint32_t seed, const uint32_t pattern)
 {
-  previous = previous * 1664525u + 1013904223u;
-  
-  return float(previous & 0X00FFFFFF) / float(0x01000000u); // Use the lower 24 bits.
-  // return float(previous >> 8) / float(0x01000000u);      // Use the upper 24 bits
+  return pcg_hash(seed ^ pcg_hash(pattern + 0x9e3779b9u));
+}
+
+
+// shuffled, owen scrambled sobol point in [0, 1). index picks the point of the pattern, dimension is in [0, 4)
+// and seed decorrelates the patterns of different source samples.
+// dimensions 0 and 1 are stratified in 2d for any power of two prefix of the indices, so 2d samples take those two
+// and further 2d samples pad with another pattern_seed() rather than dimensions 2 and 3.
+inline float sobol_owen(uint32_t index, const uint32_t dimension, const uint32_t seed)
+{
+  static constexpr SobolDirections directions;
+
+  index = nested_uniform_scramble(index, seed);
+  uint32_t x = 0;
+  for (int bit = 0; index; ++bit, index >>= 1) {
+    if (index & 1u) x ^= directions.v[dimension][bit];
+  }
+  x = nested_uniform_scramble(x, pcg_hash(seed ^ dimension));
+  return static_cast<float>(x >> 8) / 16777216.0f;
 }
 
 
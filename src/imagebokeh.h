@@ -1,15 +1,21 @@
 #pragma once
 
-#include "../../Eigen/Eigen/Core"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
 
+#include "../../Eigen/Eigen/Core"
 
-// xorshift fast random number generator
-inline uint32_t xor128_02(void){
-  static uint32_t x = 123456789, y = 362436069, z = 521288629, w = 88675123;
-  uint32_t t = x ^ (x << 11);
-  x = y; y = z; z = w;
-  return w = (w ^ (w >> 19) ^ t ^ (t >> 8));
-}
+#include "lens_cache.h"
 
 
 // arnold texture loading function
@@ -18,327 +24,306 @@ inline bool LoadTexture(const AtString path, void *pixelData){
 }
 
 
-struct arrayCompare{
-    const float *values;
-    inline arrayCompare(const float *_values) :values(_values) {}
-    inline bool operator()(int _lhs, int _rhs) const{
-        return values[_lhs] > values[_rhs];
-    }
+// one level of the bokeh kernel pyramid: an alias table (Vose) over its pixels, weighted by luminance
+struct BokehKernelLevel {
+    int size = 0;
+    std::vector<float> probability; // per pixel, chance of keeping the pixel itself instead of its alias
+    std::vector<int> alias; // per pixel, the pixel that fills up the rest of its slot
 };
 
 
-class imageData{
-private:
-    int x, y, nchannels;
-    float *pixelData;
-    float *cdfRow;
-    float *cdfColumn;
-    int *rowIndices;
-    int *columnIndices;
+// preprocessed bokeh image, the levels halve in resolution, finest first.
+// the source pixels aren't kept, sampling only needs the alias tables.
+struct BokehKernel {
+    static const int max_size = 1024; // larger images are filtered down, kernels are never rendered that large
+    static const int min_size = 16;
 
-public:
-    imageData()
-        : x(0), y(0), nchannels(0)
-        , pixelData(0), cdfRow(0), cdfColumn(0)
-        , rowIndices(0), columnIndices(0) {
-    }
+    std::vector<BokehKernelLevel> levels;
 
-    ~imageData(){
-        invalidate();
+    int64_t memory_usage() const {
+        int64_t bytes = 0;
+        for (const auto &level : levels) bytes += level.size * level.size * (sizeof(float) + sizeof(int));
+        return bytes;
     }
 
-    bool isValid() const{
-        return (x * y * nchannels > 0 && nchannels >= 3);
-    }
-
-    void invalidate(){
-        if (pixelData){
-            AiAddMemUsage(-x * y * nchannels * sizeof(float), AtString("lentil"));
-            AiFree(pixelData);
-            pixelData = 0;
-        }
-        if (cdfRow){
-            AiAddMemUsage(-y * sizeof(float), AtString("lentil"));
-            AiFree(cdfRow);
-            cdfRow = 0;
+    static void build_level(std::vector<double> luminance, const int size, BokehKernelLevel &level){
+        const int npixels = size * size;
+        level.size = size;
+        level.probability.assign(npixels, 1.0f);
+        level.alias.resize(npixels);
+
+        // scaled so the average is 1
+        double totalValue = 0.0;
+        for (const double value : luminance) totalValue += value;
+        if (totalValue <= 0.0){
+            std::fill(luminance.begin(), luminance.end(), 1.0);
+            totalValue = npixels;
         }
-        if (cdfColumn){
-            AiAddMemUsage(-x * y * sizeof(float), AtString("lentil"));
-            AiFree(cdfColumn);
-            cdfColumn = 0;
-        }
-        if (rowIndices){
-            AiAddMemUsage(-y * sizeof(int), AtString("lentil"));
-            AiFree(rowIndices);
-            rowIndices = 0;
+        const double scale = static_cast<double>(npixels) / totalValue;
+        for (double &value : luminance) value *= scale;
+
+        std::vector<int> small, large;
+        small.reserve(npixels);
+        large.reserve(npixels);
+        for (int i = 0; i < npixels; ++i){
+            level.alias[i] = i;
+            (luminance[i] < 1.0 ? small : large).push_back(i);
         }
-        if (columnIndices){
-            AiAddMemUsage(-x * y * sizeof(int), AtString("lentil"));
-            AiFree(columnIndices);
-            columnIndices = 0;
+
+        // pair every underfull slot with an overfull pixel, what's left is full up to rounding error
+        while (!small.empty() && !large.empty()){
+            const int s = small.back(); small.pop_back();
+            const int l = large.back();
+            level.probability[s] = static_cast<float>(luminance[s]);
+            level.alias[s] = l;
+            luminance[l] -= 1.0 - luminance[s];
+            if (luminance[l] < 1.0){
+                large.pop_back();
+                small.push_back(l);
+            }
         }
-        x = y = nchannels = 0;
     }
 
-    bool read(const char *bokeh_kernel_filename){
-        invalidate();
-        int64_t nbytes = 0;
-
-        AiMsgInfo("[LENTIL] Reading image using Arnold API: %s", bokeh_kernel_filename);
-        AtString path(bokeh_kernel_filename);
-
-        unsigned int iw, ih, nc;
-        if (!AiTextureGetResolution(path, &iw, &ih) || !AiTextureGetNumChannels(path, &nc)){ return false; }
-
-        x = static_cast<int>(iw);
-        y = static_cast<int>(ih);
-        nchannels = static_cast<int>(nc);
-        
-        if (x != y){
-            invalidate();
-            AiMsgError("[LENTIL] Bokeh image is not square");
-            return false;
+    // 2x2 box filter, odd sizes round up and average the pixels that exist
+    static std::vector<double> downsample(const std::vector<double> &luminance, const int size, int &new_size){
+        new_size = (size + 1) / 2;
+        std::vector<double> result(new_size * new_size, 0.0);
+        for (int r = 0; r < new_size; ++r){
+            for (int c = 0; c < new_size; ++c){
+                double sum = 0.0;
+                int count = 0;
+                for (int j = 2*r; j < std::min(2*r + 2, size); ++j){
+                    for (int i = 2*c; i < std::min(2*c + 2, size); ++i){
+                        sum += luminance[j*size + i];
+                        ++count;
+                    }
+                }
+                result[r*new_size + c] = sum / count;
+            }
         }
+        return result;
+    }
 
-        nbytes = x * y * nchannels * sizeof(float);
-        AiAddMemUsage(nbytes, AtString("lentil"));
-        pixelData = (float*)AiMalloc(nbytes);
+    static std::shared_ptr<BokehKernel> build(std::vector<double> luminance, int size){
+        auto kernel = std::make_shared<BokehKernel>();
+        while (size > max_size) luminance = downsample(luminance, size, size);
 
-        if (!LoadTexture(path, pixelData)){
-            invalidate();
-            return false;
+        while (true){
+            kernel->levels.emplace_back();
+            build_level(luminance, size, kernel->levels.back());
+            if (size <= min_size) break;
+            luminance = downsample(luminance, size, size);
         }
-
-        AiMsgInfo("[LENTIL] Bokeh Image Width: %d", x);
-        AiMsgInfo("[LENTIL] Bokeh Image Height: %d", y);
-        AiMsgInfo("[LENTIL] Bokeh Image Channels: %d", nchannels);
-        AiMsgInfo("[LENTIL] Total amount of bokeh pixels to process: %d", x * y);
-
-        // DEBUG_ONLY({
-        //     // print out raw pixel data
-        //     int npixels = x * y;
-        //     for (int i = 0, j = 0; i < npixels; i++){
-        //         std::cout << "[";
-        //         for (int k = 0; k < nchannels; k++, j++){
-        //             std::cout << pixelData[j];
-        //             if (k + 1 < nchannels){
-        //                 std::cout << ", ";
-        //             }
-        //         }
-        //         std::cout << "]";
-        //         if (i + 1 < npixels){
-        //             std::cout << ", ";
-        //         }
-        //     }
-        //     std::cout << "----------------------------------------------" << std::endl;
-        //     std::cout << "----------------------------------------------" << std::endl;
-        // })
-
-        bokehProbability();
-
-        return true;
+        return kernel;
     }
 
-    // Importance sampling
-    void bokehProbability(){
-        if (!isValid()){ return; }
-
-        // initialize arrays
-        int64_t nbytes = x * y * sizeof(float);
-        int64_t totalTempBytes = 0;
-
-        AiAddMemUsage(nbytes, AtString("lentil"));
-        float *pixelValues = (float*)AiMalloc(nbytes);
-        totalTempBytes += nbytes;
-
-        AiAddMemUsage(nbytes, AtString("lentil"));
-        float *normalizedPixelValues = (float*)AiMalloc(nbytes);
-        totalTempBytes += nbytes;
-
-        int npixels = x * y;
-        int o1 = (nchannels >= 2 ? 1 : 0);
-        int o2 = (nchannels >= 3 ? 2 : o1);
-        float totalValue = 0.0f;
-
-        // for every pixel, stuff going wrong here
-        for (int i = 0, j = 0; i < npixels; ++i, j += nchannels){
-            // store pixel value in array
-            pixelValues[i] = pixelData[j] * 0.3f + pixelData[j + o1] * 0.59f + pixelData[j + o2] * 0.11f;
-            totalValue += pixelValues[i];
-
-            // DEBUG_ONLY(std::cout << "Pixel Luminance: " << i << " -> " << pixelValues[i] << std::endl);
+    // binary layout: magic, source path, source mtime, level count, then per level its size and both tables
+    bool write(const std::string &filename, const std::string &source_path, const int64_t source_mtime) const {
+        std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+        if (!file) return false;
+        const uint32_t magic = file_magic;
+        const uint32_t path_length = static_cast<uint32_t>(source_path.size());
+        const uint32_t level_count = static_cast<uint32_t>(levels.size());
+        file.write(reinterpret_cast<const char*>(&magic), sizeof(magic));
+        file.write(reinterpret_cast<const char*>(&path_length), sizeof(path_length));
+        file.write(source_path.data(), path_length);
+        file.write(reinterpret_cast<const char*>(&source_mtime), sizeof(source_mtime));
+        file.write(reinterpret_cast<const char*>(&level_count), sizeof(level_count));
+        for (const auto &level : levels){
+            file.write(reinterpret_cast<const char*>(&level.size), sizeof(level.size));
+            file.write(reinterpret_cast<const char*>(level.probability.data()), level.probability.size() * sizeof(float));
+            file.write(reinterpret_cast<const char*>(level.alias.data()), level.alias.size() * sizeof(int));
         }
+        return static_cast<bool>(file);
+    }
 
-        // DEBUG_ONLY({
-        //     std::cout << "----------------------------------------------" << std::endl;
-        //     std::cout << "DEBUG: Total Pixel Value: " << totalValue << std::endl;
-        //     std::cout << "----------------------------------------------" << std::endl;
-        //     std::cout << "----------------------------------------------" << std::endl;
-        // })
-
-        // normalize pixel values so sum = 1
-        float invTotalValue = 1.0f / totalValue;
-        float totalNormalizedValue = 0.0f;
-
-        for (int i = 0; i < npixels; ++i){
-            normalizedPixelValues[i] = pixelValues[i] * invTotalValue;
-
-            totalNormalizedValue += normalizedPixelValues[i];
-
-            // DEBUG_ONLY(std::cout << "Normalized Pixel Value: " << i << ": " << normalizedPixelValues[i] << std::endl);
+    static std::shared_ptr<BokehKernel> read(const std::string &filename, const std::string &source_path, const int64_t source_mtime){
+        std::ifstream file(filename, std::ios::binary);
+        if (!file) return nullptr;
+
+        uint32_t magic = 0, path_length = 0, level_count = 0;
+        int64_t mtime = 0;
+        file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+        file.read(reinterpret_cast<char*>(&path_length), sizeof(path_length));
+        if (!file || magic != file_magic || path_length != source_path.size()) return nullptr;
+        std::string path(path_length, '\0');
+        file.read(&path[0], path_length);
+        file.read(reinterpret_cast<char*>(&mtime), sizeof(mtime));
+        file.read(reinterpret_cast<char*>(&level_count), sizeof(level_count));
+        if (!file || path != source_path || mtime != source_mtime || level_count == 0 || level_count > 32) return nullptr;
+
+        auto kernel = std::make_shared<BokehKernel>();
+        kernel->levels.resize(level_count);
+        for (auto &level : kernel->levels){
+            file.read(reinterpret_cast<char*>(&level.size), sizeof(level.size));
+            if (!file || level.size <= 0 || level.size > max_size) return nullptr;
+            level.probability.resize(level.size * level.size);
+            level.alias.resize(level.size * level.size);
+            file.read(reinterpret_cast<char*>(level.probability.data()), level.probability.size() * sizeof(float));
+            file.read(reinterpret_cast<char*>(level.alias.data()), level.alias.size() * sizeof(int));
+            if (!file) return nullptr;
+
+            // the sampler indexes the level with the alias directly, a damaged file must not point outside of it
+            const int pixels = level.size * level.size;
+            if (std::any_of(level.alias.begin(), level.alias.end(), [pixels](const int alias){ return alias < 0 || alias >= pixels; })) return nullptr;
         }
+        return kernel;
+    }
 
-        // DEBUG_ONLY({
-        //     std::cout << "----------------------------------------------" << std::endl;
-        //     std::cout << "DEBUG: Total Normalized Pixel Value: " << totalNormalizedValue << std::endl;
-        //     std::cout << "----------------------------------------------" << std::endl;
-        //     std::cout << "----------------------------------------------" << std::endl;
-        // })
-
-        // calculate sum for each row
-        nbytes = y * sizeof(float);
-        AiAddMemUsage(nbytes, AtString("lentil"));
-        float *summedRowValues = (float*)AiMalloc(nbytes);
-        totalTempBytes += nbytes;
-
-        for (int i = 0, k = 0; i < y; ++i){
-
-            summedRowValues[i] = 0.0f;
-
-            for (int j = 0; j < x; ++j, ++k){
+private:
+    static const uint32_t file_magic = 0x314b424c; // "LBK1"
+};
 
-                summedRowValues[i] += normalizedPixelValues[k];
-            }
 
-            // DEBUG_ONLY(std::cout << "Summed Values row [" << i << "]: " << summedRowValues[i] << std::endl);
+// Preprocessed bokeh kernels, keyed by image path and modification time.
+// Kept in memory for the lifetime of the plugin (a few of them) and on disk in lentil_cache_directory(),
+// so neither IPR updates nor new renders have to load and preprocess the same image again.
+class BokehKernelCache {
+public:
+    static const size_t max_entries = 8;
+
+    static std::shared_ptr<const BokehKernel> get(const std::string &path, const int64_t mtime, const std::function<std::shared_ptr<BokehKernel>()> &build){
+        std::lock_guard<std::mutex> lock(mutex());
+        auto &cache = entries();
+        const auto it = cache.find(path);
+
+        // can't tell whether an image without mtime changed, those are always rebuilt and never served from the memory or disk cache
+        const bool persistent = mtime != 0;
+        if (persistent && it != cache.end() && it->second.mtime == mtime) return it->second.kernel;
+        const std::string filename = disk_path(path);
+        std::shared_ptr<BokehKernel> kernel = persistent ? BokehKernel::read(filename, path, mtime) : nullptr;
+        if (kernel) AiMsgInfo("[LENTIL] Read preprocessed bokeh kernel from %s", filename.c_str());
+        else {
+            kernel = build();
+            if (!kernel) return nullptr;
+            if (persistent) kernel->write(filename, path, mtime);
         }
 
+        if (it != cache.end()) erase(it);
+        if (cache.size() >= max_entries) erase(cache.begin());
+        AiAddMemUsage(kernel->memory_usage(), AtString("lentil"));
+        cache[path] = Entry{mtime, kernel};
+        return kernel;
+    }
 
-        // DEBUG_ONLY({
-        //     // calculate sum of all row values, just to debug
-        //     float totalNormalizedRowValue = 0.0f;
-        //     for (int i = 0; i < y; ++i){
-        //         totalNormalizedRowValue += summedRowValues[i];
-        //     }
-        //     std::cout << "----------------------------------------------" << std::endl;
-        //     std::cout << "Debug: Summed Row Value: " << totalNormalizedRowValue << std::endl;
-        //     std::cout << "----------------------------------------------" << std::endl;
-        // })
+    static int64_t modification_time(const char *path){
+        struct stat attributes;
+        if (stat(path, &attributes) != 0) return 0;
+        return static_cast<int64_t>(attributes.st_mtime);
+    }
 
+private:
+    struct Entry {
+        int64_t mtime;
+        std::shared_ptr<const BokehKernel> kernel;
+    };
 
-        // make array of indices
-        nbytes = y * sizeof(int);
-        AiAddMemUsage(nbytes, AtString("lentil"));
-        rowIndices = (int*)AiMalloc(nbytes);
+    static std::mutex &mutex() { static std::mutex m; return m; }
+    static std::map<std::string, Entry> &entries() { static std::map<std::string, Entry> e; return e; }
 
-        for (int i = 0; i < y; ++i){
-            rowIndices[i] = i;
-        }
+    static void erase(std::map<std::string, Entry>::iterator it){
+        AiAddMemUsage(-it->second.kernel->memory_usage(), AtString("lentil"));
+        entries().erase(it);
+    }
 
-        std::sort(rowIndices, rowIndices + y, arrayCompare(summedRowValues));
+    static std::string disk_path(const std::string &path){
+        char name[64];
+        std::snprintf(name, sizeof(name), "/lentil_bokeh_%016llx.bin", static_cast<unsigned long long>(std::hash<std::string>()(path)));
+        return lentil_cache_directory() + name;
+    }
+};
 
-        // DEBUG_ONLY({
-        //     // print values
-        //     for (int i = 0; i < y; ++i){
-        //         std::cout << "PDF row [" << rowIndices[i] << "]: " << summedRowValues[rowIndices[i]] << std::endl;
-        //     }
-        //     std::cout << "----------------------------------------------" << std::endl;
-        //     std::cout << "----------------------------------------------" << std::endl;
-        // })
 
-        // For every row, add the sum of all previous row (cumulative distribution function)
-        nbytes = y * sizeof(float);
-        AiAddMemUsage(nbytes, AtString("lentil"));
-        cdfRow = (float*)AiMalloc(nbytes);
+class imageData{
+private:
+    std::shared_ptr<const BokehKernel> kernel;
 
-        float prevVal = 0.0f;
-        for (int i = 0; i < y; ++i){
-            cdfRow[i] = prevVal + summedRowValues[rowIndices[i]];
-            prevVal = cdfRow[i];
+public:
+    imageData() {}
 
-            // DEBUG_ONLY(std::cout << "CDF row [" << rowIndices[i] << "]: " << cdfRow[i] << std::endl);
-        }
+    ~imageData(){
+        invalidate();
+    }
 
-        // DEBUG_ONLY({
-        //     std::cout << "----------------------------------------------" << std::endl;
-        //     std::cout << "----------------------------------------------" << std::endl;
-        // })
+    bool isValid() const{
+        return kernel && !kernel->levels.empty();
+    }
 
-        nbytes = npixels * sizeof(float);
-        AiAddMemUsage(nbytes, AtString("lentil"));
-        float *normalizedValuesPerRow = (float*)AiMalloc(nbytes);
-        totalTempBytes += nbytes;
-
-        // divide pixel values of each pixel by the sum of the pixel values of that row (Normalize)
-        for (int r = 0, i = 0; r < y; ++r){
-            for (int c = 0; c < x; ++c, ++i){
-                // avoid division by 0
-                if ((normalizedPixelValues[i] != 0) && (summedRowValues[r] != 0)){
-                    normalizedValuesPerRow[i] = normalizedPixelValues[i] / summedRowValues[r];
-                }
-                else {
-                    normalizedValuesPerRow[i] = 0;
-                }
+    void invalidate(){
+        kernel.reset();
+    }
 
-                // DEBUG_ONLY(std::cout << "Normalized Pixel value per row: " << i << ": " << normalizedValuesPerRow[i] << std::endl);
-            }
-        }
+    bool read(const char *bokeh_kernel_filename){
+        invalidate();
+        const std::string path(bokeh_kernel_filename);
+        kernel = BokehKernelCache::get(path, BokehKernelCache::modification_time(bokeh_kernel_filename), [&path]{
+            return load(path);
+        });
+        if (!isValid()) return false;
+
+        AiMsgInfo("[LENTIL] Bokeh kernel: %d levels, %dx%d to %dx%d", static_cast<int>(kernel->levels.size()),
+                  kernel->levels.front().size, kernel->levels.front().size, kernel->levels.back().size, kernel->levels.back().size);
+        return true;
+    }
 
-        // DEBUG_ONLY({
-        //     std::cout << "----------------------------------------------" << std::endl;
-        //     std::cout << "----------------------------------------------" << std::endl;
-        // })
+    // reads the image and turns it into a kernel pyramid
+    static std::shared_ptr<BokehKernel> load(const std::string &filename){
+        AiMsgInfo("[LENTIL] Reading image using Arnold API: %s", filename.c_str());
+        AtString path(filename.c_str());
 
-        // sort column values from highest to lowest per row (probability density function)
-        nbytes = npixels * sizeof(int);
-        AiAddMemUsage(nbytes, AtString("lentil"));
-        columnIndices = (int*)AiMalloc(nbytes);
+        unsigned int iw, ih, nc;
+        if (!AiTextureGetResolution(path, &iw, &ih) || !AiTextureGetNumChannels(path, &nc)){ return nullptr; }
 
-        for (int i = 0; i < npixels; i++){
-            columnIndices[i] = i;
-        }
+        const int x = static_cast<int>(iw);
+        const int y = static_cast<int>(ih);
+        const int nchannels = static_cast<int>(nc);
 
-        for (int i = 0; i < npixels; i += x){
-            std::sort(columnIndices + i, columnIndices + i + x, arrayCompare(normalizedValuesPerRow));
+        if (x != y){
+            AiMsgError("[LENTIL] Bokeh image is not square");
+            return nullptr;
         }
+        if (x * y * nchannels <= 0){ return nullptr; }
 
-        // DEBUG_ONLY({
-        //     for (int i = 0; i < npixels; ++i){
-        //         std::cout << "PDF column [" << columnIndices[i] << "]: " << normalizedValuesPerRow[columnIndices[i]] << std::endl;
-        //     }
-
-        //     std::cout << "----------------------------------------------" << std::endl;
-        //     std::cout << "----------------------------------------------" << std::endl;
-        // })
+        AiMsgInfo("[LENTIL] Bokeh Image Width: %d", x);
+        AiMsgInfo("[LENTIL] Bokeh Image Height: %d", y);
+        AiMsgInfo("[LENTIL] Bokeh Image Channels: %d", nchannels);
 
-        // For every column per row, add the sum of all previous columns (cumulative distribution function)
-        nbytes = npixels * sizeof(float);
+        const int64_t nbytes = x * y * nchannels * sizeof(float);
         AiAddMemUsage(nbytes, AtString("lentil"));
-        cdfColumn = (float*)AiMalloc(nbytes);
-
-        for (int r = 0, i = 0; r < y; ++r){
-            prevVal = 0.0f;
-
-            for (int c = 0; c < x; ++c, ++i){
-                cdfColumn[i] = prevVal + normalizedValuesPerRow[columnIndices[i]];
-                prevVal = cdfColumn[i];
-
-                // DEBUG_ONLY(std::cout << "CDF column [" << columnIndices[i] << "]: " << cdfColumn[i] << std::endl);
+        float *pixelData = (float*)AiMalloc(nbytes);
+
+        const bool loaded = LoadTexture(path, pixelData);
+        std::vector<double> luminance;
+        if (loaded){
+            // luminance in double, large kernels have millions of pixels
+            const int o1 = (nchannels >= 2 ? 1 : 0);
+            const int o2 = (nchannels >= 3 ? 2 : o1);
+            luminance.resize(x * y);
+            for (int i = 0, j = 0; i < x * y; ++i, j += nchannels){
+                luminance[i] = std::max(0.0f, pixelData[j] * 0.3f + pixelData[j + o1] * 0.59f + pixelData[j + o2] * 0.11f);
             }
         }
 
-        // DEBUG_ONLY(std::cout << "----------------------------------------------" << std::endl);
+        AiAddMemUsage(-nbytes, AtString("lentil"));
+        AiFree(pixelData);
+        if (!loaded) return nullptr;
 
-        // Release and untrack memory
-        AiAddMemUsage(-totalTempBytes, AtString("lentil"));
-        AiFree(pixelValues);
-        AiFree(normalizedPixelValues);
-        AiFree(summedRowValues);
-        AiFree(normalizedValuesPerRow);
+        return BokehKernel::build(std::move(luminance), x);
+    }
+
+    // coarsest level that still resolves a circle of confusion of this many pixels across
+    int levelForCoc(const float coc_pixels) const{
+        if (!isValid()) return 0;
+        int level = 0;
+        const int levels = static_cast<int>(kernel->levels.size());
+        while (level + 1 < levels && kernel->levels[level + 1].size >= coc_pixels) ++level;
+        return level;
     }
 
     // Sample image
-    void bokehSample(float randomNumberRow, float randomNumberColumn, Eigen::Vector2d &lens, float stratification_r1, float stratification_r2){
+    // randomNumberRow picks the slot, randomNumberColumn decides between the slot's pixel and its alias,
+    // the stratification numbers jitter the sample within the pixel
+    void bokehSample(float randomNumberRow, float randomNumberColumn, Eigen::Vector2d &lens, float stratification_r1, float stratification_r2, const int level_index = 0){
         if (!isValid()){
             AiMsgWarning("Invalid bokeh image data.");
             lens(0) = 0.0;
@@ -346,68 +331,23 @@ public:
             return;
         }
 
-        // print random number between 0 and 1
-        // DEBUG_ONLY(std::cout << "RANDOM NUMBER ROW: " << randomNumberRow << std::endl);
-
-        // find upper bound of random number in the array
-        float *pUpperBound = std::upper_bound(cdfRow, cdfRow + y, randomNumberRow);
-
-        int r = 0;
-        pUpperBound >= (cdfRow + y) ? r = y - 1 : r = static_cast<int>(pUpperBound - cdfRow);
-
-        // find actual pixel row
-        int actualPixelRow = rowIndices[r];
-
-        // recalculate pixel row so that the center pixel is (0,0) - might run into problems with images of dimensions like 2x2, 4x4, 6x6, etc
-        int recalulatedPixelRow = actualPixelRow - ((x - 1) / 2);
-
-        // DEBUG_ONLY({
-        //     // print values
-        //     std::cout << "INDEX IN CDF ROW: " << r << std::endl;
-        //     std::cout << "ACTUAL PIXEL ROW: " << actualPixelRow << std::endl;
-        //     std::cout << "RECALCULATED PIXEL ROW: " << recalulatedPixelRow << std::endl;
-        //     std::cout << "----------------------------------------------" << std::endl;
-        //     std::cout << "----------------------------------------------" << std::endl;
-        //     std::cout << "RANDOM NUMBER COLUMN: " << randomNumberColumn << std::endl;
-        // })
-
-        int startPixel = actualPixelRow * x;
-        // DEBUG_ONLY(std::cout << "START PIXEL: " << startPixel << std::endl);
+        const BokehKernelLevel &level = kernel->levels[std::min(level_index, static_cast<int>(kernel->levels.size()) - 1)];
+        const int x = level.size;
+        const int y = level.size;
+        const int npixels = x * y;
+        const int slot = std::min(static_cast<int>(randomNumberRow * npixels), npixels - 1);
+        const int pixel = randomNumberColumn < level.probability[slot] ? slot : level.alias[slot];
 
-
-        // find upper bound of random number in the array
-        float *pUpperBoundColumn = std::upper_bound(cdfColumn + startPixel, cdfColumn + startPixel + x, randomNumberColumn);
-
-        int c = 0;
-        pUpperBoundColumn >= cdfColumn + startPixel + x ? c = startPixel + x - 1 : c = static_cast<int>(pUpperBoundColumn - cdfColumn);
-
-        // find actual pxel column
-        int actualPixelColumn = columnIndices[c];
-        int relativePixelColumn = actualPixelColumn - startPixel;
-        int recalulatedPixelColumn = relativePixelColumn - ((y - 1) / 2);
-
-        // DEBUG_ONLY({
-        //     // print values
-        //     std::cout << "INDEX IN CDF COLUMN: " << c << std::endl;
-        //     std::cout << "ACTUAL PIXEL COLUMN: " << actualPixelColumn << std::endl;
-        //     std::cout << "RELATIVE PIXEL COLUMN (starting from 0): " << relativePixelColumn << std::endl;
-        //     std::cout << "RECALCULATED PIXEL COLUMN: " << recalulatedPixelColumn << std::endl;
-        //     std::cout << "----------------------------------------------" << std::endl;
-        //     std::cout << "----------------------------------------------" << std::endl;
-        // })
+        // recalculate pixel row/column so that the center pixel is (0,0) - might run into problems with images of dimensions like 2x2, 4x4, 6x6, etc
+        const int recalulatedPixelRow = pixel / x - ((x - 1) / 2);
+        const int recalulatedPixelColumn = pixel % x - ((y - 1) / 2);
 
         // to get the right image orientation, flip the x and y coordinates and then multiply the y values by -1 to flip the pixels vertically
-        float flippedRow = static_cast<float>(recalulatedPixelColumn);
-        float flippedColumn = recalulatedPixelRow * -1.0f;
+        const float flippedRow = static_cast<float>(recalulatedPixelColumn) + (stratification_r1 - 0.5f);
+        const float flippedColumn = (static_cast<float>(recalulatedPixelRow) + (stratification_r2 - 0.5f)) * -1.0f;
 
         // send values back
-        lens[0] = static_cast<float>(flippedRow) / static_cast<float>(x)* 2.0;
-        lens[1] = static_cast<float>(flippedColumn) / static_cast<float>(y)* 2.0;
-
-        // stratification_r1 = (stratification_r1 - 0.5) * 2.0;
-        // stratification_r2 = (stratification_r2 - 0.5) * 2.0;
-
-        // lens[0] = lens(0) + stratification_r1/(double)x;
-        // lens[1] = lens(1) + stratification_r2/(double)y;
+        lens[0] = flippedRow / static_cast<float>(x) * 2.0;
+        lens[1] = flippedColumn / static_cast<float>(y) * 2.0;
     }
-};
\ No newline at end of file
+};
@@ -392,16 +392,20 @@ static inline float lens_aperture_area(const float radius, const int blades)
 
 
 
-inline std::vector<double> logarithmic_values()
+// built once, the table is only read afterwards
+inline const std::vector<double> &logarithmic_values()
 {
-  double min = 0.0;
-  double max = 45.0;
-  double exponent = 2.0; // sharpness
-  std::vector<double> log;
-
-  for(double i = -1.0; i <= 1.0; i += 0.0001) {
-    log.push_back((i < 0 ? -1 : 1) * std::pow(i, exponent) * (max - min) + min);
-  }
+  static const std::vector<double> log = []{
+    double min = 0.0;
+    double max = 45.0;
+    double exponent = 2.0; // sharpness
+    std::vector<double> values;
+
+    for(double i = -1.0; i <= 1.0; i += 0.0001) {
+      values.push_back((i < 0 ? -1 : 1) * std::pow(i, exponent) * (max - min) + min);
+    }
+    return values;
+  }();
 
   return log;
 }
@@ -423,9 +427,9 @@ inline float calculate_distance_vec2(Eigen::Vector2d a, Eigen::Vector2d b) {
     return std::sqrt(std::pow(b[0] - a[0], 2) +  std::pow(b[1] - a[1], 2));
 }
 
-inline Eigen::Vector3d chromatic_abberration_empirical(Eigen::Vector2d pos, float distance_mult, Eigen::Vector2d &lens, float apertureradius) {
+inline Eigen::Vector3d chromatic_abberration_empirical(Eigen::Vector2d pos, float distance_mult, Eigen::Vector2d &lens, float apertureradius, RandomStream &random) {
   float distance_to_center = calculate_distance_vec2(Eigen::Vector2d(0.0, 0.0), pos);
-  int random_aperture = static_cast<int>(std::floor((xor128() / 4294967296.0) * 3.0));
+  int random_aperture = static_cast<int>(std::floor(random.next() * 3.0));
 
   Eigen::Vector2d aperture_0_center(0.0, 0.0);
   Eigen::Vector2d aperture_1_center(- pos * distance_to_center * distance_mult);
@@ -472,49 +476,6 @@ inline Eigen::Vector3d chromatic_abberration_empirical(Eigen::Vector2d pos, floa
    
 
 
-// Improved concentric mapping code by Dave Cline [peter shirley´s blog]
-// maps points on the unit square onto the unit disk uniformly
-inline void concentricDiskSample(float ox, float oy, Eigen::Vector2d &lens, float bias, float squarelerp, float squeeze_x)
-{
-    if (ox == 0.0 && oy == 0.0){
-        lens(0) = 0.0;
-        lens(1) = 0.0;
-        return;
-    }
-
-    float phi, r;
-
-    // switch coordinate space from [0, 1] to [-1, 1]
-    const float a = 2.0 * ox - 1.0;
-    const float b = 2.0 * oy - 1.0;
-
-    if ((a * a) > (b * b)){
-        r = a;
-        phi = 0.78539816339 * (b / a);
-    }
-    else {
-        r = b;
-        phi = (AI_PIOVER2) - ((0.78539816339) * (a / b));
-    }
-
-    if (bias != 0.5) r = AiBias(std::abs(r), bias) * (r < 0 ? -1 : 1);
-
-
-    bool fast_trigo = true;
-
-    const float cos_phi = fast_trigo ? fast_cos(phi) : std::cos(phi);
-    const float sin_phi = fast_trigo ? fast_sin(phi) : std::sin(phi);
-    lens(0) = r * cos_phi;
-    lens(1) = r * sin_phi;
-
-    if (squarelerp > 0.0){
-        lens(0) = linear_interpolate(squarelerp, lens(0), a);
-        lens(1) = linear_interpolate(squarelerp, lens(1), b);
-    }
-}
-
-
-
 // creates a secondary, virtual aperture resembling the exit pupil on a real lens
 inline bool empericalOpticalVignetting(AtVector origin, AtVector direction, float apertureRadius, float opticalVignettingRadius, float opticalVignettingDistance){
     // because the first intersection point of the aperture is already known, I can just linearly scale it by the distance to the second aperture
@@ -537,6 +498,66 @@ inline bool empericalOpticalVignettingSquare(AtVector origin, AtVector direction
 	return !(dist > std::pow(radius, power));
 }
 
+// area of the part x >= h of a disk with radius r centered at the origin
+inline double circular_segment_area(const double r, const double h) {
+    const double hc = std::min(std::max(h, -r), r);
+    return r*r*std::acos(hc/r) - hc*std::sqrt(std::max(0.0, r*r - hc*hc));
+}
+
+// uniformly samples the part x >= h of a disk with radius r centered at the origin.
+// x is found by inverting the segment area (safeguarded newton), y is uniform along the chord.
+inline void sample_circular_segment(const double r, const double h, const double u1, const double u2, double &x, double &y) {
+    const double target = circular_segment_area(r, h) * (1.0 - u1);
+    double lo = std::max(h, -r), hi = r;
+    x = 0.5 * (lo + hi);
+    for (int i = 0; i < 20; ++i){
+        const double f = circular_segment_area(r, x) - target; // decreasing in x
+        if (std::abs(f) < 1e-9 * r * r) break;
+        if (f > 0.0) lo = x;
+        else hi = x;
+        const double df = -2.0 * std::sqrt(std::max(0.0, r*r - x*x));
+        double x_next = (df != 0.0) ? x - f/df : 0.5 * (lo + hi);
+        if (x_next <= lo || x_next >= hi) x_next = 0.5 * (lo + hi);
+        x = x_next;
+    }
+    const double half_chord = std::sqrt(std::max(0.0, r*r - x*x));
+    y = (2.0 * u2 - 1.0) * half_chord;
+}
+
+// uniformly samples the intersection of a disk at the origin with a second disk, the "cat's eye" of optical vignetting.
+// the intersection is split in two circular segments by the radical line. returns false when the disks don't overlap.
+inline bool sample_disk_intersection(double u1, const double u2, const double radius_a, const Eigen::Vector2d &center_b, const double radius_b, Eigen::Vector2d &p) {
+    const double d = center_b.norm();
+    if (d >= radius_a + radius_b) return false;
+
+    // one disk inside of the other
+    if (d <= std::abs(radius_a - radius_b)){
+        Eigen::Vector2d unit_disk(0.0, 0.0);
+        concentric_disk_sample(u1, u2, unit_disk, false);
+        if (radius_a <= radius_b) p = unit_disk * radius_a;
+        else p = center_b + unit_disk * radius_b;
+        return true;
+    }
+
+    const Eigen::Vector2d ex = center_b / d;
+    const Eigen::Vector2d ey(-ex(1), ex(0));
+    const double x0 = (d*d + radius_a*radius_a - radius_b*radius_b) / (2.0*d); // radical line, along ex
+    const double area_a = circular_segment_area(radius_a, x0);
+    const double area_b = circular_segment_area(radius_b, d - x0);
+
+    double x = 0.0, y = 0.0;
+    const double prob_a = area_a / (area_a + area_b);
+    if (u1 < prob_a){
+        sample_circular_segment(radius_a, x0, u1 / prob_a, u2, x, y);
+    } else {
+        sample_circular_segment(radius_b, d - x0, (u1 - prob_a) / (1.0 - prob_a), u2, x, y);
+        x = d - x; // segment of the second disk faces the origin
+    }
+
+    p = ex * x + ey * y;
+    return true;
+}
+
 // emperical mapping
 inline float lerp_squircle_mapping(float amount) {
     return 1.0 + std::log(1.0+amount)*std::exp(amount*3.0);
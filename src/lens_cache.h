@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+// directory for lentil's on-disk caches: $LENTIL_CACHE_DIR, or the system temp directory when that isn't set
+inline std::string lentil_cache_directory() {
+    const char *dir = std::getenv("LENTIL_CACHE_DIR");
+    if (!dir || !*dir) dir = std::getenv("TMPDIR");
+    if (!dir || !*dir) dir = std::getenv("TEMP");
+    if (!dir || !*dir) dir = std::getenv("TMP");
+#ifdef _WIN32
+    if (!dir || !*dir) dir = ".";
+#else
+    if (!dir || !*dir) dir = "/tmp";
+#endif
+    return std::string(dir);
+}
+
+
+// Persistent cache for the polynomial optics lens solves (sensor shift for a focus distance, aperture radius for an f-stop).
+// These only depend on the lens and a handful of inputs, so they are kept in memory for the lifetime of the plugin
+// and in a small text file on disk so that new renders and IPR sessions can skip the solves altogether.
+// The file lives in lentil_cache_directory().
+// Each line is "<key> <value> <value> ...", later lines override earlier ones.
+class LensSolveCache {
+public:
+    // bump when the solvers change, so stale entries are ignored
+    static const int version = 1;
+
+    static std::string make_key(const char *kind, const char *lens_name, const std::vector<double> &inputs) {
+        std::ostringstream key;
+        key << "v" << version << "|" << kind << "|";
+        for (const char *c = lens_name; c && *c; ++c) key << (*c == ' ' ? '_' : *c);
+        char buffer[32];
+        for (const double input : inputs) {
+            std::snprintf(buffer, sizeof(buffer), "|%.9g", input);
+            key << buffer;
+        }
+        return key.str();
+    }
+
+    static bool lookup(const std::string &key, std::vector<double> &values) {
+        std::lock_guard<std::mutex> lock(mutex());
+        load();
+        const auto it = entries().find(key);
+        if (it == entries().end()) return false;
+        values = it->second;
+        return true;
+    }
+
+    static void store(const std::string &key, const std::vector<double> &values) {
+        std::lock_guard<std::mutex> lock(mutex());
+        load();
+        entries()[key] = values;
+
+        std::ofstream file(path(), std::ios::app);
+        if (!file) return; // read-only location, keep the in-memory entry only
+        file << key;
+        char buffer[32];
+        for (const double value : values) {
+            std::snprintf(buffer, sizeof(buffer), " %.17g", value);
+            file << buffer;
+        }
+        file << "\n";
+    }
+
+private:
+    static std::mutex &mutex() { static std::mutex m; return m; }
+    static std::map<std::string, std::vector<double>> &entries() { static std::map<std::string, std::vector<double>> e; return e; }
+
+    static std::string path() {
+        return lentil_cache_directory() + "/lentil_lens_solve_cache.txt";
+    }
+
+    static void load() {
+        static bool loaded = false;
+        if (loaded) return;
+        loaded = true;
+
+        std::ifstream file(path());
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            std::string key;
+            if (!(fields >> key)) continue;
+            std::vector<double> values;
+            double value = 0.0;
+            while (fields >> value) values.push_back(value);
+            if (!values.empty()) entries()[key] = values;
+        }
+    }
+};
+
+
+// Focus breathing of a polynomial optics lens: sensor shift, effective focal length and field of view
+// tabulated against focus distance. Nodes are spaced uniformly in vergence (1/distance), from infinity down to
+// the near limit, which keeps the spacing tight where focus changes quickly and makes the curve close to linear.
+// Built once per lens and wavelength, see Camera::setup_focus_breathing_curve().
+struct FocusBreathingCurve {
+    static const int nodes = 48;
+
+    double near_distance = 0.0; // mm
+    std::vector<double> sensor_shift; // mm
+    std::vector<double> effective_focal_length; // mm
+    std::vector<double> field_of_view; // radians
+
+    bool empty() const { return sensor_shift.empty(); }
+
+    void clear() {
+        near_distance = 0.0;
+        sensor_shift.clear();
+        effective_focal_length.clear();
+        field_of_view.clear();
+    }
+
+    // distance of node i in mm, node 0 is at infinity
+    double distance(const int i) const {
+        return i == 0 ? 999999999.0 : near_distance * static_cast<double>(nodes - 1) / static_cast<double>(i);
+    }
+
+    // false when the focus distance is closer than the curve reaches, which has to be solved directly
+    bool covers(const double focus_distance) const {
+        return !empty() && focus_distance >= near_distance;
+    }
+
+    void lookup(const double focus_distance, double &shift, double &efl, double &fov) const {
+        const double t = std::min(std::max(near_distance / focus_distance, 0.0), 1.0) * (nodes - 1);
+        const int i = std::min(static_cast<int>(t), nodes - 2);
+        const double f = t - i;
+        shift = sensor_shift[i] + f * (sensor_shift[i+1] - sensor_shift[i]);
+        efl = effective_focal_length[i] + f * (effective_focal_length[i+1] - effective_focal_length[i]);
+        fov = field_of_view[i] + f * (field_of_view[i+1] - field_of_view[i]);
+    }
+
+    // flat layout for LensSolveCache: near distance followed by the three curves
+    std::vector<double> serialize() const {
+        std::vector<double> values{near_distance};
+        values.insert(values.end(), sensor_shift.begin(), sensor_shift.end());
+        values.insert(values.end(), effective_focal_length.begin(), effective_focal_length.end());
+        values.insert(values.end(), field_of_view.begin(), field_of_view.end());
+        return values;
+    }
+
+    bool deserialize(const std::vector<double> &values) {
+        if (values.size() != 1 + 3*nodes) return false;
+        near_distance = values[0];
+        sensor_shift.assign(values.begin() + 1, values.begin() + 1 + nodes);
+        effective_focal_length.assign(values.begin() + 1 + nodes, values.begin() + 1 + 2*nodes);
+        field_of_view.assign(values.begin() + 1 + 2*nodes, values.end());
+        return true;
+    }
+};
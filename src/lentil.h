@@ -8,12 +8,20 @@
 #include "../../Eigen/Eigen/Dense"
 
 #include "imagebokeh.h"
+#include "aperture_atlas.h"
+#include "aperture_shape.h"
+#include "spectral.h"
+#include "lens_cache.h"
+#include "splat_convergence.h"
+#include "visibility_cache.h"
+#include "summed_area.h"
 #include "lens.h"
 #include "global.h"
 
 #include "../CryptomatteArnold/cryptomatte/cryptomatte.h"
+#include <atomic>
 #include <chrono>
-#include <thread>
+#include <future>
 #include <regex>
 
 #include "aov_data.h"
@@ -83,8 +91,92 @@ enum ChromaticType{
     red_cyan
 };
 
+// how the thin lens draws aperture samples when optical vignetting is enabled
+enum OpticalVignettingSampling{
+    vignetting_none,        // optical vignetting disabled
+    vignetting_rejection,   // sample the whole aperture, retry when vignetted
+    vignetting_analytic,    // sample the intersection of the two circular apertures directly
+    vignetting_atlas        // sample from the precomputed per field position table
+};
+
+// geometry of the inner/outer pupil of a polynomial optics lens
+enum PupilGeometry{
+    pupil_sphere,
+    pupil_cyl_y,
+    pupil_cyl_x
+};
+
+
+inline PupilGeometry pupil_geometry_from_string(const std::string &geometry){
+    if (geometry == "cyl-y") return pupil_cyl_y;
+    else if (geometry == "cyl-x") return pupil_cyl_x;
+    return pupil_sphere;
+}
+
+
+
+
+
+
+
+// derivatives of the camera ray wrt the screen space position (sx, sy)
+struct RayDerivatives {
+    AtVector dOdsx = AtVector(0,0,0);
+    AtVector dOdsy = AtVector(0,0,0);
+    AtVector dDdsx = AtVector(0,0,0);
+    AtVector dDdsy = AtVector(0,0,0);
+};
+
+
+// per source sample data handed to the backward redistribution kernels
+struct RedistributionSample {
+    int px;
+    int py;
+    AtVector camera_space_position; // in cm
+    AtVector world_space_position;
+    AtMatrix cam_to_world;
+    float depth;
+    bool is_from_skydome;
+    int samples;
+    float inverse_sample_density;
+    float inv_samples;
+    float fitted_bidir_add_energy;
+    int bokeh_level; // bokeh image pyramid level matching the circle of confusion
+    unsigned int sampling_seed; // seed of the sobol patterns of this source sample
+    SplatConvergence::Batch *convergence_batch = nullptr; // splats per tile for the adaptive budget, null when it is off
+    AtAOVSampleIterator *iterator;
+    AtShaderGlobals *sg;
+};
+
+
+// affine map from the unit aperture to screen space, see Camera::redistribute_thinlens()
+struct FootprintTransform {
+    AtVector2 origin = AtVector2(0.0, 0.0);
+    AtVector2 axis_x = AtVector2(0.0, 0.0);
+    AtVector2 axis_y = AtVector2(0.0, 0.0);
+};
+
+enum FootprintCoverage {
+    footprint_inside,
+    footprint_partial,
+    footprint_outside
+};
 
 
+// source samples of a pixel that are redistributed as one, see Camera::cluster_redistribution_sample().
+// the representative carries the weighted averages of its members, their weights (inverse sample density) add up.
+struct RedistributionCluster {
+    RedistributionSample rs;
+    std::vector<std::map<float, float>> crypto_cache;
+    std::vector<AtRGBA> aov_values;
+    AtRGBA colour; // of the first member, later members are compared against it
+    AtVector2 offset; // subpixel position of the first member
+    float time;
+    float coc_radius; // in pixels
+    float splat_demand; // unclamped sample counts of the members
+    float luminance;
+    int sampleid; // first member, the iterator is put back on it for the redistribution
+};
 
 
 
@@ -96,11 +188,28 @@ struct Camera
     CameraType cameraType;
     ChromaticType abb_chromatic_type;
     imageData image;
+    ApertureAtlas aperture_atlas;
+    ApertureShapeSampler aperture_sampler;
+    SpectralToRgb spectral_to_rgb;
+    FocusBreathingCurve focus_breathing;
 
     std::vector<float> zbuffer;
     std::vector<float> zbuffer_debug; // separate zbuffer for the debug AOV, which only tracks redistributed depth values
+    std::vector<float> gather_weight_buffer; // per pixel sums of the dim samples, weighted by their inverse density
+    std::vector<float> gather_coc_buffer; // weighted sum of the circle of confusion radii, in pixels
+    std::vector<float> gather_depth_buffer; // weighted sum of the depths
+    std::vector<float> pixel_min_depth_buffer; // nearest depth of all samples in the pixel, for the depth aware blur
+    std::atomic<bool> gather_pending{false}; // dim samples were added since the imager last blurred them
     std::vector<AOVData> aovs;
     std::vector<float> filter_weight_buffer;
+    SplatConvergence splat_convergence;
+    FrameSplatBudget splat_budget;
+    VisibilityStats visibility_stats;
+    std::atomic<uint64_t> time_sliced_sources{0}; // sources filtered in place because their pixel ran out of time
+    std::atomic<uint64_t> redistributed_sources{0}; // throughput of the selected redistribution kernel, see report_redistribution()
+    std::atomic<uint64_t> redistributed_splats{0};
+    std::atomic<uint64_t> redistribution_nanoseconds{0};
+    std::string redistribution_kernel_name;
 
     // lens constants PO
     const char* lens_name;
@@ -118,6 +227,8 @@ struct Camera
     double lens_aperture_radius_at_fstop;
     std::string lens_inner_pupil_geometry;
     std::string lens_outer_pupil_geometry;
+    PupilGeometry inner_pupil_geometry;
+    PupilGeometry outer_pupil_geometry;
 
     double focus_distance;
 	double sensor_width;
@@ -131,6 +242,12 @@ struct Camera
     double bidir_add_energy_minimum_luminance;
     float bidir_add_energy;
     float bidir_add_energy_transition;
+    float bidir_adaptive_threshold; // relative noise target of the adaptive splat budget, 0 disables it
+    float bidir_frame_splat_budget; // millions of splats per render pass, 0 disables the budget
+    float bidir_gather_luminance; // defocused samples below this luminance are blurred by the imager, 0 disables it
+    float bidir_cluster_tolerance; // relative tolerance for merging the source samples of a pixel, 0 disables clustering
+    bool bidir_visibility_cache; // share the lens occlusion probes between the splats of a source sample
+    float bidir_pixel_time_budget; // milliseconds of redistribution per pixel, 0 disables the time slice
     bool enable_bidir_transmission;
     bool enable_skydome;
     float exposure;
@@ -139,6 +256,7 @@ struct Camera
     float focal_length;
     float optical_vignetting_distance;
     float optical_vignetting_radius;
+    OpticalVignettingSampling optical_vignetting_sampling = vignetting_none;
     float abb_spherical;
     float abb_coma;
     float abb_distortion;
@@ -150,6 +268,18 @@ struct Camera
     double max_fstop;
 	double aperture_radius;
 	double sensor_shift;
+    double unit_scale; // centimeters to scene units
+    ApertureShape aperture_shape;
+
+    typedef void (Camera::*TraceRayFwKernel)(int &tries, const double sx, const double sy,
+                                              AtVector &origin, AtVector &direction, AtRGB &weight,
+                                              double &r1, double &r2, RayDerivatives *derivs);
+    TraceRayFwKernel trace_ray_fw_kernel = nullptr;
+
+    typedef void (Camera::*RedistributionKernel)(const RedistributionSample &rs,
+                                                 std::vector<std::map<float, float>> &crypto_cache,
+                                                 std::vector<AtRGBA> &aov_values);
+    RedistributionKernel redistribution_kernel = nullptr;
     
     AtNode *filter_node;
     AtNode *camera_node;
@@ -168,6 +298,7 @@ struct Camera
     int shift_x;
     int shift_y;
     int samples;
+    double frame_aspect_ratio_without_region;
     bool redistribution;
     float current_inv_density;
     float filter_width;
@@ -192,14 +323,21 @@ struct Camera
 
     bool cryptomatte_lentil = false;
     bool imager_print_once_only = false;
-    bool crypto_in_same_queue = false;
+    AtNode *crypto_node = nullptr;
+    AtRenderSession *render_session = nullptr; // polled for interruptions during the redistribution
+    std::atomic<bool> aov_setup_pending{false};
+
+    // inputs of the expensive setup stages at the time they last ran, so an IPR update only redoes the stages whose inputs changed
+    std::vector<double> lens_setup_settings;
+    std::vector<std::string> aov_plan_outputs;
+    size_t aov_plan_operator_aovs = 0;
+    AtString lentil_operator_name;
 
 
 public:
 
     Camera() {
         if (!l_critsec_active) AiMsgError("[Lentil] Critical section was not initialized. ");
-        crypto_in_same_queue = false;
     }
 
     ~Camera() {
@@ -209,85 +347,229 @@ public:
     
 
     void setup_camera (AtUniverse *universe) {
-        lentil_crit_sec_enter();
-
-        destroy_buffers();
+        const auto time_start = std::chrono::high_resolution_clock::now();
 
+        // parameters are read under the lock, the stages below only touch their own part of the camera
+        lentil_crit_sec_enter();
         options_node = AiUniverseGetOptions(universe);
         camera_node = AiUniverseGetCamera(universe);
         get_arnold_options();
         get_lentil_camera_params();
-        camera_model_specific_setup();
-
-        // make probability functions of the bokeh image
-        // if (!(po->stored_useImage == AiNodeGetBool(node, "bokeh_enable_imagePO") && po->stored_path == AiNodeGetStr(node, "bokeh_image_pathPO")) {
-        image.invalidate();
-        if (bokeh_enable_image && !image.read(bokeh_image_path.c_str())){
-            AiMsgError("[LENTIL CAMERA PO] Couldn't open bokeh image!");
-            AiRenderAbort();
-        }
-
+        lentil_crit_sec_leave();
 
         #ifdef CM_VERSION
             AiMsgInfo("[LENTIL] Version: %s", CM_VERSION);
         #endif
 
+        // lens and bokeh image stages are independent of each other and of the aov setup, run them alongside it
+        double lens_time = 0.0;
+        double bokeh_time = 0.0;
+        std::future<void> lens_task = std::async(std::launch::async, [this, &lens_time]{
+            const auto stage_start = std::chrono::high_resolution_clock::now();
+            camera_model_specific_setup();
+            select_trace_ray_fw_kernel();
+            lens_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - stage_start).count();
+        });
+        std::future<void> bokeh_task = std::async(std::launch::async, [this, &bokeh_time]{
+            const auto stage_start = std::chrono::high_resolution_clock::now();
+            setup_bokeh_image();
+            bokeh_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - stage_start).count();
+        });
+
+        const auto aov_start = std::chrono::high_resolution_clock::now();
+        setup_redistribution(universe);
+        const double aov_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - aov_start).count();
+
+        lens_task.get();
+        bokeh_task.get();
+
+        // depends on the lens stage (vignetting sampling, aperture shape)
+        lentil_crit_sec_enter();
+        select_redistribution_kernel();
         lentil_crit_sec_leave();
 
+        check_ray_derivatives();
+
+        const double total_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - time_start).count();
+        AiMsgInfo("[LENTIL CAMERA] setup took %.1f ms (lens %.1f ms, bokeh image %.1f ms, aovs %.1f ms%s)",
+                  total_time, lens_time, bokeh_time, aov_time, aov_setup_pending.load() ? ", deferred until cryptomatte is ready" : "");
+    }
 
 
-        redistribution = get_bidirectional_status(universe); // this should include AA level test
+    // make probability functions of the bokeh image.
+    // preprocessed kernels are cached by path and modification time, so this only does real work when the image changed
+    void setup_bokeh_image() {
+        if (!bokeh_enable_image) {
+            image.invalidate();
+        } else if (!image.read(bokeh_image_path.c_str())){
+            AiMsgError("[LENTIL CAMERA PO] Couldn't open bokeh image!");
+            AiRenderAbort();
+        }
+    }
+
+
+    void setup_redistribution(AtUniverse *universe) {
+        redistribution = get_bidirectional_status(universe);
         if (redistribution) {
-            
-            crypto_in_same_queue = false;
 
             // get cryptomatte node
-            AtNode *crypto_node = nullptr;
+            crypto_node = nullptr;
+            cryptomatte_lentil = false;
             AtArray* aov_shaders_array = AiNodeGetArray(options_node, AtString("aov_shaders"));
             for (size_t i=0; i<AiArrayGetNumElements(aov_shaders_array); ++i) {
                 AtNode* aov_node = static_cast<AtNode*>(AiArrayGetPtr(aov_shaders_array, i));
                 if (AiNodeEntryGetNameAtString(AiNodeGetNodeEntry(aov_node)) == AtString("cryptomatte")) {
                     crypto_node = aov_node;
+                    cryptomatte_lentil = true;
                 }
             }
 
-            // POTENTIAL BUG: what if lentil updates on the same thread as cryptomatte, and is in the queue before crypto? That would be a deadlock.
-            // this is an ugly solution, continually checking if cryptomatte already did the setup.
-            if (crypto_node){
-                CryptomatteData* crypto_data = reinterpret_cast<CryptomatteData*>(AiNodeGetLocalData(crypto_node));
-                int time_cnt = 0;
-                while (!crypto_data->is_setup_completed) {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(50));
-                    ++time_cnt;
-
-                    if (time_cnt == 500) { // guess that crypto is in the same queue, behind lentil
-                        crypto_in_same_queue = true;
-                        AiMsgInfo("[LENTIL] Waiting for Cryptomatte setup reached time-out.");
-                        break;
-                    }
-                }
-                cryptomatte_lentil = true;
-            }
+            // the aov setup needs cryptomatte to have finished its own setup. cryptomatte may update after lentil on the same thread,
+            // so instead of waiting for it here, the setup is deferred and completed by whichever lentil node updates once it's ready.
+            aov_setup_pending.store(true, std::memory_order_release);
+            complete_aov_setup(universe);
+        } else {
+            aov_setup_pending.store(false, std::memory_order_release);
+            destroy_buffers();
+            aov_plan_outputs.clear();
+        }
+    }
+
 
+    // true once cryptomatte, when used, has finished its setup
+    bool cryptomatte_is_ready() const {
+        if (!crypto_node) return true;
+        const CryptomatteData* crypto_data = reinterpret_cast<CryptomatteData*>(AiNodeGetLocalData(crypto_node));
+        return crypto_data && crypto_data->is_setup_completed;
+    }
+
+
+    // runs the deferred aov and filter setup as soon as cryptomatte is ready. called from the camera, filter and imager node updates,
+    // only the first call after cryptomatte finished does the work.
+    void complete_aov_setup(AtUniverse *universe) {
+        if (!aov_setup_pending.load(std::memory_order_acquire) || !cryptomatte_is_ready()) return;
+
+        lentil_crit_sec_enter();
+        if (aov_setup_pending.load(std::memory_order_acquire)) run_aov_setup(universe);
+        lentil_crit_sec_leave();
+    }
+
+    // the deferred setup itself, the caller holds the critical section
+    void run_aov_setup(AtUniverse *universe) {
+        if (!aov_plan_is_current(universe)) {
+            destroy_buffers();
+            setup_lentil_aovs(universe);
+            setup_crypto_aovs(universe);
+            aovcount = aovs.size();
+            sanitize_aov_list(aovs);
+            store_aov_plan(universe);
+        }
+        setup_filter(universe);
+        aov_setup_pending.store(false, std::memory_order_release);
+    }
 
-            // once crypto has been setup I can do my own setup
-            if (!crypto_in_same_queue){
-                setup_lentil_aovs(universe);
-                setup_crypto_aovs(universe);
+
+    // IPR restarts and pauses (and failed renders) make the remaining redistribution work stale, so it is dropped.
+    // polled once per pixel by the filter and every redistribution_poll_interval splat attempts by the kernels.
+    static const unsigned int redistribution_poll_interval = 1024;
+
+    inline bool render_interrupted() const {
+        const AtRenderStatus status = AiRenderGetStatus(render_session);
+        return status == AI_RENDER_STATUS_RESTARTING || status == AI_RENDER_STATUS_PAUSED || status == AI_RENDER_STATUS_FAILED;
+    }
+
+    inline bool render_interrupted_at(const unsigned int attempt) const {
+        return attempt % redistribution_poll_interval == redistribution_poll_interval - 1 && render_interrupted();
+    }
+
+    // time spent in the redistribution kernel, summed over the threads. Rendering the same frame with different settings
+    // replays the same sources through each specialised kernel, which makes this the benchmark of the kernel selection.
+    void report_redistribution() const {
+        const uint64_t sources = redistributed_sources.load();
+        if (sources == 0) return;
+        const double seconds = redistribution_nanoseconds.load() * 1e-9;
+        AiMsgInfo("[LENTIL BIDIRECTIONAL] %s kernel: %.2fM sources, %.2fM splats in %.2f s of thread time (%.2f Msplats/s per thread)",
+                  redistribution_kernel_name.c_str(), sources * 1e-6, redistributed_splats.load() * 1e-6, seconds,
+                  seconds > 0.0 ? redistributed_splats.load() * 1e-6 / seconds : 0.0);
+    }
+
+    void report_pixel_time_budget() const {
+        if (bidir_pixel_time_budget <= 0.0) return;
+        AiMsgInfo("[LENTIL BIDIRECTIONAL] pixel time budget %.2f ms: %llu samples were filtered in place instead of redistributed",
+                  bidir_pixel_time_budget, static_cast<unsigned long long>(time_sliced_sources.load()));
+    }
+
+
+    // rendering started with the aov setup still pending: cryptomatte finished its setup after the last lentil node update.
+    // outputs can't be rewritten anymore at this point, Arnold keeps the filters it started with. The first filtered pixel
+    // only completes the setup when the outputs were already rewritten for this aov list during the updates (then only the
+    // buffers are missing), otherwise it falls back to regular filtering instead of writing to unallocated buffers.
+    inline void complete_aov_setup_before_filtering(AtUniverse *universe) {
+        if (!aov_setup_pending.load(std::memory_order_acquire)) return;
+
+        lentil_crit_sec_enter();
+        if (aov_setup_pending.load(std::memory_order_acquire)) {
+            if (cryptomatte_is_ready() && aov_plan_is_current(universe)) {
+                AiMsgInfo("[LENTIL] Cryptomatte became ready after the node updates, allocating the aov buffers before filtering.");
                 setup_filter(universe);
+            } else {
+                AiMsgWarning("[LENTIL] Cryptomatte wasn't set up before rendering started, disabling bidirectional sampling.");
+                redistribution = false;
             }
+            aov_setup_pending.store(false, std::memory_order_release);
         }
+        lentil_crit_sec_leave();
     }
 
 
+    // convert from sphere/cylinder space of the outer pupil to camera space
+    template<PupilGeometry Geometry>
+    inline void outer_pupil_to_camera_space(const Eigen::Vector2d &pos, const Eigen::Vector2d &dir, Eigen::Vector3d &cs_pos, Eigen::Vector3d &cs_dir)
+    {
+        if constexpr (Geometry == pupil_cyl_y) cylinderToCs(pos, dir, cs_pos, cs_dir, -lens_outer_pupil_curvature_radius, lens_outer_pupil_curvature_radius, true);
+        else if constexpr (Geometry == pupil_cyl_x) cylinderToCs(pos, dir, cs_pos, cs_dir, -lens_outer_pupil_curvature_radius, lens_outer_pupil_curvature_radius, false);
+        else sphereToCs(pos, dir, cs_pos, cs_dir, -lens_outer_pupil_curvature_radius, lens_outer_pupil_curvature_radius);
+    }
+
+    inline void outer_pupil_to_camera_space(const Eigen::Vector2d &pos, const Eigen::Vector2d &dir, Eigen::Vector3d &cs_pos, Eigen::Vector3d &cs_dir)
+    {
+        switch (outer_pupil_geometry){
+            case pupil_cyl_y: { outer_pupil_to_camera_space<pupil_cyl_y>(pos, dir, cs_pos, cs_dir); } break;
+            case pupil_cyl_x: { outer_pupil_to_camera_space<pupil_cyl_x>(pos, dir, cs_pos, cs_dir); } break;
+            default: { outer_pupil_to_camera_space<pupil_sphere>(pos, dir, cs_pos, cs_dir); }
+        }
+    }
+
+
+    // wavelength fed to the polynomials for a visible wavelength. abb_chromatic scales the dispersion
+    // around the wavelength the lens is focused at, 1.0 is the dispersion of the lens itself.
+    inline double chromatic_lens_wavelength(const double wavelength) const {
+        return lambda + abb_chromatic * (wavelength - lambda);
+    }
+
+
+    // forward ray kernels, instantiated per camera configuration so the per-ray path doesn't branch on settings.
+    // the right instantiation is picked once per update in select_trace_ray_fw_kernel().
+    template<bool EnableDof, ApertureShape Shape, PupilGeometry OuterPupil, bool Chromatic>
     inline void trace_ray_fw_po(int &tries, 
                                 const double sx, const double sy,
                                 AtVector &origin, AtVector &direction, AtRGB &weight, 
-                                double &r1, double &r2, const bool deriv_ray)
+                                double &r1, double &r2, RayDerivatives *derivs)
     {
 
         tries = 0;
         bool ray_succes = false;
+        RandomStream random(random_key(sx, sy, r1, r2));
+
+        // a single hero wavelength per camera ray, the colour of the wavelength goes into the ray weight
+        double wavelength = lambda;
+        AtRGB spectral_weight = AI_RGB_WHITE;
+        if constexpr (Chromatic) {
+            double hero[1];
+            SpectralToRgb::hero_wavelengths<1>(random.next(), hero);
+            wavelength = chromatic_lens_wavelength(hero[0]);
+            spectral_weight = spectral_to_rgb(hero[0]);
+        }
 
         Eigen::VectorXd sensor(5); sensor.setZero();
         Eigen::VectorXd aperture(5); aperture.setZero();
@@ -299,28 +581,29 @@ public:
             sensor(0) = sx * (sensor_width * 0.5);
             sensor(1) = sy * (sensor_width * 0.5);
             sensor(2) = sensor(3) = 0.0;
-            sensor(4) = lambda;
+            sensor(4) = wavelength;
 
             aperture.setZero();
             out.setZero();
 
-
-            if (!enable_dof) aperture(0) = aperture(1) = 0.0; // no dof, all rays through single aperture point
-            
+            // no dof, all rays through single aperture point
             Eigen::Vector2d unit_disk(0.0, 0.0);
             
-            if (enable_dof) {
-                if (!deriv_ray && tries > 0){ // first iteration comes from arnold blue noise sampler
-                    r1 = xor128() / 4294967296.0;
-                    r2 = xor128() / 4294967296.0;
+            if constexpr (EnableDof) {
+                if (tries > 0){ // first iteration comes from arnold blue noise sampler, retries are stratified per ray
+                    r1 = sobol_owen(tries, 0, random.key);
+                    r2 = sobol_owen(tries, 1, random.key);
                 }
                 
-                if (bokeh_enable_image) {
-                    image.bokehSample(r1, r2, unit_disk, xor128() / 4294967296.0, xor128() / 4294967296.0);
-                } else if (bokeh_aperture_blades < 2) {
-                    concentric_disk_sample(r1, r2, unit_disk, true);
+                if constexpr (Shape == aperture_image) {
+                    image.bokehSample(r1, r2, unit_disk, random.next(), random.next());
                 } else {
-                    lens_sample_triangular_aperture(unit_disk(0), unit_disk(1), r1, r2, 1.0, bokeh_aperture_blades);
+                    // only propose the part of the aperture that can transmit at this sensor position. The exact test below
+                    // still rejects, so the samples stay uniform over the transmitting region the (dilated) atlas covers
+                    double r1_atlas = r1, r2_atlas = r2;
+                    aperture_atlas.sample(sx, sy, r1_atlas, r2_atlas);
+
+                    aperture_sampler.sample<Shape>(r1_atlas, r2_atlas, unit_disk);
                 }
             }
 
@@ -333,42 +616,13 @@ public:
             // if (empirical_ca_dist > 0.0) {
             //   Eigen::Vector2d sensor_pos(sensor[0], sensor[1]);
             //   Eigen::Vector2d aperture_pos(aperture[0], aperture[1]);
-            //   weight = chromatic_abberration_empirical(sensor_pos, empirical_ca_dist, aperture_pos, aperture_radius);
+            //   weight = chromatic_abberration_empirical(sensor_pos, empirical_ca_dist, aperture_pos, aperture_radius, random);
             //   aperture(0) = aperture_pos(0);
             //   aperture(1) = aperture_pos(1);
             // }
             
 
-            if (enable_dof) {
-                // aperture sampling, to make sure ray is able to propagate through whole lens system
-                lens_pt_sample_aperture(sensor, aperture, sensor_shift);
-            }
-            
-
-            // move to beginning of polynomial
-            sensor(0) += sensor(2) * sensor_shift;
-            sensor(1) += sensor(3) * sensor_shift;
-
-
-            // propagate ray from sensor to outer lens element
-            double transmittance = lens_evaluate(sensor, out);
-            if(transmittance <= 0.0) {
-                ++tries;
-                continue;
-            }
-
-
-            // crop out by outgoing pupil
-            if( out(0)*out(0) + out(1)*out(1) > lens_outer_pupil_radius*lens_outer_pupil_radius){
-                ++tries;
-                continue;
-            }
-
-
-            // crop at inward facing pupil
-            const double px = sensor(0) + sensor(2) * lens_back_focal_length;
-            const double py = sensor(1) + sensor(3) * lens_back_focal_length; //(note that lens_back_focal_length is the back focal length, i.e. the distance unshifted sensor -> pupil)
-            if (px*px + py*py > lens_inner_pupil_radius*lens_inner_pupil_radius) {
+            if (!po_ray_transmits<EnableDof>(sensor, aperture, out)) {
                 ++tries;
                 continue;
             }
@@ -376,6 +630,7 @@ public:
             ray_succes = true;
         }
 
+        if constexpr (Chromatic) weight *= spectral_weight;
         if (ray_succes == false) weight = AI_RGB_ZERO;
 
 
@@ -384,39 +639,19 @@ public:
         Eigen::Vector2d outdir(out[2], out[3]);
         Eigen::Vector3d cs_origin(0,0,0);
         Eigen::Vector3d cs_direction(0,0,0);
-        if (lens_outer_pupil_geometry == "cyl-y") cylinderToCs(outpos, outdir, cs_origin, cs_direction, -lens_outer_pupil_curvature_radius, lens_outer_pupil_curvature_radius, true);
-        else if (lens_outer_pupil_geometry == "cyl-x") cylinderToCs(outpos, outdir, cs_origin, cs_direction, -lens_outer_pupil_curvature_radius, lens_outer_pupil_curvature_radius, false);
-        else sphereToCs(outpos, outdir, cs_origin, cs_direction, -lens_outer_pupil_curvature_radius, lens_outer_pupil_curvature_radius);
+        outer_pupil_to_camera_space<OuterPupil>(outpos, outdir, cs_origin, cs_direction);
         
         origin = AtVector(cs_origin(0), cs_origin(1), cs_origin(2));
         direction = AtVector(cs_direction(0), cs_direction(1), cs_direction(2));
 
-
-        switch (unitModel){
-            case mm:
-            {
-                origin *= -1.0; // reverse rays and convert to cm (from mm)
-                direction *= -1.0; //reverse rays and convert to cm (from mm)
-            } break;
-            case cm:
-            { 
-                origin *= -0.1; // reverse rays and convert to cm (from mm)
-                direction *= -0.1; //reverse rays and convert to cm (from mm)
-            } break;
-            case dm:
-            {
-                origin *= -0.01; // reverse rays and convert to cm (from mm)
-                direction *= -0.01; //reverse rays and convert to cm (from mm)
-            } break;
-            case m:
-            {
-                origin *= -0.001; // reverse rays and convert to cm (from mm)
-                direction *= -0.001; //reverse rays and convert to cm (from mm)
-            }
-        }
+        // reverse rays and convert to scene units (from mm)
+        origin *= -0.1 * unit_scale;
+        direction *= -0.1 * unit_scale;
 
         direction = AiV3Normalize(direction);
 
+        if (ray_succes && derivs) trace_ray_fw_po_derivatives<EnableDof, OuterPupil>(sensor, out, *derivs);
+
         // Nan bailout
         if (origin[0] != origin[0] || origin[1] != origin[1] || origin[2] != origin[2] || 
             direction[0] != direction[0] || direction[1] != direction[1] || direction[2] != direction[2])
@@ -428,18 +663,105 @@ public:
 
 
 
+    // solves the sensor direction through the aperture point and propagates to the outer pupil.
+    // sensor is moved to the beginning of the polynomial. returns false when the ray gets vignetted.
+    template<bool EnableDof>
+    inline bool po_ray_transmits(Eigen::VectorXd &sensor, Eigen::VectorXd &aperture, Eigen::VectorXd &out)
+    {
+        if constexpr (EnableDof) {
+            // aperture sampling, to make sure ray is able to propagate through whole lens system
+            lens_pt_sample_aperture(sensor, aperture, sensor_shift);
+        }
+
+        // move to beginning of polynomial
+        sensor(0) += sensor(2) * sensor_shift;
+        sensor(1) += sensor(3) * sensor_shift;
+
+        // propagate ray from sensor to outer lens element
+        double transmittance = lens_evaluate(sensor, out);
+        if(transmittance <= 0.0) return false;
+
+        // crop out by outgoing pupil
+        if( out(0)*out(0) + out(1)*out(1) > lens_outer_pupil_radius*lens_outer_pupil_radius) return false;
+
+        // crop at inward facing pupil
+        const double px = sensor(0) + sensor(2) * lens_back_focal_length;
+        const double py = sensor(1) + sensor(3) * lens_back_focal_length; //(note that lens_back_focal_length is the back focal length, i.e. the distance unshifted sensor -> pupil)
+        if (px*px + py*py > lens_inner_pupil_radius*lens_inner_pupil_radius) return false;
+
+        return true;
+    }
+
+
+    // derivatives of the forward PO ray wrt the screen space position, chained through the aperture solve
+    // and the polynomial jacobians. Only the (cheap) pupil to camera space conversion is finite differenced.
+    // sensor is the solved polynomial input (already moved by the sensor shift), out the outer pupil result.
+    template<bool EnableDof, PupilGeometry OuterPupil>
+    inline void trace_ray_fw_po_derivatives(const Eigen::VectorXd &sensor, const Eigen::VectorXd &out, RayDerivatives &derivs)
+    {
+        const double dsensor = sensor_width * 0.5;
+
+        // derivative of the polynomial input (x, y, dx, dy) wrt (sx, sy)
+        Eigen::Matrix<double, 4, 2> dq; dq.setZero();
+        dq(0,0) = dq(1,1) = dsensor;
+
+        if constexpr (EnableDof) {
+            // directions are solved such that the aperture point stays fixed:
+            // Ja_pos * dpos + (Ja_dir + shift * Ja_pos) * ddir = 0
+            Eigen::Matrix<double, 5, 5> Ja;
+            lens_evaluate_aperture_jacobian(sensor, Ja);
+            const Eigen::Matrix2d ja_pos = Ja.block<2,2>(0,0);
+            const Eigen::Matrix2d ja_dir = Ja.block<2,2>(0,2);
+            const Eigen::Matrix2d ddir = -(ja_dir + sensor_shift * ja_pos).inverse() * ja_pos * dsensor;
+            dq.block<2,2>(0,0) += sensor_shift * ddir;
+            dq.block<2,2>(2,0) = ddir;
+        }
+
+        Eigen::Matrix<double, 5, 5> J;
+        lens_evaluate_jacobian(sensor, J);
+        const Eigen::Matrix<double, 4, 2> dout = J.block<4,4>(0,0) * dq;
+
+        const double h = 1e-4;
+        const Eigen::Vector2d outpos(out(0), out(1));
+        const Eigen::Vector2d outdir(out(2), out(3));
+        Eigen::Vector3d cs_pos(0,0,0), cs_dir(0,0,0);
+        outer_pupil_to_camera_space<OuterPupil>(outpos, outdir, cs_pos, cs_dir);
+        cs_dir.normalize();
+
+        AtVector dO[2], dD[2];
+        for (int i = 0; i < 2; i++){
+            const Eigen::Vector2d outpos_h = outpos + h * dout.block<2,1>(0,i);
+            const Eigen::Vector2d outdir_h = outdir + h * dout.block<2,1>(2,i);
+            Eigen::Vector3d cs_pos_h(0,0,0), cs_dir_h(0,0,0);
+            outer_pupil_to_camera_space<OuterPupil>(outpos_h, outdir_h, cs_pos_h, cs_dir_h);
+            cs_dir_h.normalize();
+
+            // reverse rays and convert to scene units (from mm), directions are normalized
+            const Eigen::Vector3d dpos = (cs_pos_h - cs_pos) * (-0.1 * unit_scale / h);
+            const Eigen::Vector3d ddir = (cs_dir_h - cs_dir) * (-1.0 / h);
+            dO[i] = AtVector(dpos(0), dpos(1), dpos(2));
+            dD[i] = AtVector(ddir(0), ddir(1), ddir(2));
+        }
+
+        derivs.dOdsx = dO[0]; derivs.dOdsy = dO[1];
+        derivs.dDdsx = dD[0]; derivs.dDdsy = dD[1];
+    }
+
+
+    template<bool EnableDof, ApertureShape Shape, bool Distortion, OpticalVignettingSampling Vignetting>
     inline void trace_ray_fw_thinlens(int &tries, 
                                     const double sx, const double sy,
                                     AtVector &origin, AtVector &dir, AtRGB &weight,
-                                    double &r1, double &r2, const bool deriv_ray){
+                                    double &r1, double &r2, RayDerivatives *derivs){
         tries = 0;
         bool ray_succes = false;
+        RandomStream random(random_key(sx, sy, r1, r2));
 
         while (!ray_succes && tries <= vignetting_retries){
             
             // distortion
             AtVector s(sx, sy, 0.0);
-            if (abb_distortion > 0.0){
+            if constexpr (Distortion){
                 AtVector2 s2 = barrelDistortion(AtVector2(sx, sy), abb_distortion);
                 s = {s2.x, s2.y, 0.0};
             }
@@ -454,21 +776,38 @@ public:
             // calculate direction vector from origin to point on lens
             AtVector dir_from_center = AiV3Normalize(p); // or norm(p-origin)
 
+
+            // aberration inputs
+            float abb_field_curvature = 0.0;
+
+            const float intersection = std::abs(focus_distance / linear_interpolate(abb_field_curvature, dir_from_center.z, 1.0));
+            const AtVector focusPoint = dir_from_center * intersection;
+
+
             // either get uniformly distributed points on the unit disk or bokeh image
             Eigen::Vector2d unit_disk(0, 0);
             
-            if (enable_dof) {
-                if (!deriv_ray && tries > 0){ // first iteration comes from arnold blue noise sampler
-                    r1 = xor128() / 4294967296.0;
-                    r2 = xor128() / 4294967296.0;
+            if constexpr (EnableDof) {
+                if (tries > 0){ // first iteration comes from arnold blue noise sampler, retries are stratified per ray
+                    r1 = sobol_owen(tries, 0, random.key);
+                    r2 = sobol_owen(tries, 1, random.key);
                 }
                 
-                if (bokeh_enable_image) {
-                    image.bokehSample(r1, r2, unit_disk, xor128() / 4294967296.0, xor128() / 4294967296.0);
-                } else if (bokeh_aperture_blades < 2) {
-                    concentricDiskSample(r1, r2, unit_disk, abb_spherical, circle_to_square, bokeh_anamorphic);
+                if constexpr (Vignetting == vignetting_analytic) {
+                    // seen from the lens, the second aperture is a disk centered at k/(1+k) * focusPoint, with k = distance ratio
+                    const double k = optical_vignetting_distance / focus_distance;
+                    const Eigen::Vector2d center(focusPoint.x * k/(1.0+k), focusPoint.y * k/(1.0+k));
+                    Eigen::Vector2d lens_sample(0, 0);
+                    if (!sample_disk_intersection(r1, r2, aperture_radius, center, aperture_radius*optical_vignetting_radius/(1.0+k), lens_sample)) break; // fully vignetted
+                    unit_disk = lens_sample / aperture_radius;
+                } else if constexpr (Shape == aperture_image) {
+                    image.bokehSample(r1, r2, unit_disk, random.next(), random.next());
                 } else {
-                    lens_sample_triangular_aperture(unit_disk(0), unit_disk(1), r1, r2, 1.0, bokeh_aperture_blades);
+                    // restrict the sample to what makes it through the second aperture at this field position
+                    double r1_sample = r1, r2_sample = r2;
+                    if constexpr (Vignetting == vignetting_atlas) aperture_atlas.sample(sx, sy, r1_sample, r2_sample);
+
+                    aperture_sampler.sample<Shape>(r1_sample, r2_sample, unit_disk);
                 }
             }
 
@@ -476,13 +815,7 @@ public:
             unit_disk(0) *= bokeh_anamorphic;
 
 
-            // aberration inputs
-            float abb_field_curvature = 0.0;
-
-
             AtVector lens(unit_disk(0) * aperture_radius, unit_disk(1) * aperture_radius, 0.0);
-            const float intersection = std::abs(focus_distance / linear_interpolate(abb_field_curvature, dir_from_center.z, 1.0));
-            const AtVector focusPoint = dir_from_center * intersection;
             AtVector dir_from_lens = AiV3Normalize(focusPoint - lens);
             
 
@@ -491,7 +824,9 @@ public:
             dir_from_lens = abb_coma_perturb(dir_from_lens, dir_from_lens, abb_coma_multiplied, false);
 
 
-            if (optical_vignetting_distance > 0.0 && !deriv_ray){
+            // the exact test stays, the atlas only narrows the proposal: a transmitting sliver it misses isn't sampled,
+            // but nothing it lets through wrongly gets a weight
+            if constexpr (Vignetting != vignetting_none){
                 if (!empericalOpticalVignettingSquare(lens, dir_from_lens, aperture_radius, optical_vignetting_radius, optical_vignetting_distance, lerp_squircle_mapping(circle_to_square))){
                     ++tries;
                     continue;
@@ -503,7 +838,7 @@ public:
             // if (emperical_ca_dist > 0.0){
             //     const AtVector2 p2(p.x, p.y);
             //     const float distance_to_center = AiV2Dist(AtVector2(0.0, 0.0), p2);
-            //     const int random_aperture = static_cast<int>(std::floor((xor128() / 4294967296.0) * 3.0));
+            //     const int random_aperture = static_cast<int>(std::floor(random.next() * 3.0));
             //     AtVector2 aperture_0_center(0.0, 0.0);
             //     AtVector2 aperture_1_center(- p2 * coc * emperical_ca_dist); //previous: change coc for dist_to_center
             //     AtVector2 aperture_2_center(p2 * coc * emperical_ca_dist);//previous: change coc for dist_to_center
@@ -534,32 +869,89 @@ public:
             // //     // output.weight.b /= sum;
             // }
 
-            origin = lens;
-            dir = dir_from_lens;
+            // closed form derivatives, the origin only depends on the lens sample.
+            // skipped without derivs, the derivative check times the kernels without them like the old finite differences.
+            if (derivs) {
+                // focusPoint is p * focus_distance/focal_length, so its derivative is the (distorted) sensor derivative scaled by that ratio.
+                AtVector ds_dsx(1.0, 0.0, 0.0);
+                AtVector ds_dsy(0.0, 1.0, 0.0);
+                if constexpr (Distortion){
+                    const float distortion_factor = 1.0 + (sx*sx + sy*sy) * abb_distortion;
+                    ds_dsx = AtVector(distortion_factor + 2.0*abb_distortion*sx*sx, 2.0*abb_distortion*sx*sy, 0.0);
+                    ds_dsy = AtVector(2.0*abb_distortion*sx*sy, distortion_factor + 2.0*abb_distortion*sy*sy, 0.0);
+                }
+                const float focus_point_scale = (sensor_width*0.5) * focus_distance / focal_length;
+                const AtVector dfocus_dsx = ds_dsx * focus_point_scale;
+                const AtVector dfocus_dsy = ds_dsy * focus_point_scale;
+
+                // the lens sample only moves with the sensor position for analytic vignetting: the cat's eye is centered at
+                // k/(1+k) * focusPoint. Its remap is differentiated with central differences, that is only the disk intersection
+                // again and no extra ray. The atlas picks the bins per sensor cell, within a cell the lens sample doesn't move.
+                AtVector dlens_dsx(0.0, 0.0, 0.0);
+                AtVector dlens_dsy(0.0, 0.0, 0.0);
+                if constexpr (EnableDof && Vignetting == vignetting_analytic) {
+                    const double k = optical_vignetting_distance / focus_distance;
+                    const Eigen::Vector2d center(focusPoint.x * k/(1.0+k), focusPoint.y * k/(1.0+k));
+                    const double vignetting_radius = aperture_radius*optical_vignetting_radius/(1.0+k);
+                    auto lens_derivative = [&](const AtVector &dfocus) {
+                        const double h = 1e-4;
+                        const Eigen::Vector2d dcenter(dfocus.x * k/(1.0+k), dfocus.y * k/(1.0+k));
+                        Eigen::Vector2d lens_plus(0, 0), lens_minus(0, 0);
+                        if (!sample_disk_intersection(r1, r2, aperture_radius, center + dcenter*h, vignetting_radius, lens_plus) ||
+                            !sample_disk_intersection(r1, r2, aperture_radius, center - dcenter*h, vignetting_radius, lens_minus)) return AtVector(0.0, 0.0, 0.0);
+                        const Eigen::Vector2d dlens = (lens_plus - lens_minus) / (2.0*h);
+                        return AtVector(dlens(0) * bokeh_anamorphic, dlens(1), 0.0);
+                    };
+                    dlens_dsx = lens_derivative(dfocus_dsx);
+                    dlens_dsy = lens_derivative(dfocus_dsy);
+                }
 
-            switch (unitModel){
-                case mm:
-                {
-                    origin *= 10.0; // reverse rays and convert to cm (from mm)
-                    dir *= 10.0; //reverse rays and convert to cm (from mm)
-                } break;
-                case cm:
-                { 
-                    origin *= 1.0; // reverse rays and convert to cm (from mm)
-                    dir *= 1.0; //reverse rays and convert to cm (from mm)
-                } break;
-                case dm:
-                {
-                    origin *= 0.1; // reverse rays and convert to cm (from mm)
-                    dir *= 0.1; //reverse rays and convert to cm (from mm)
-                } break;
-                case m:
-                {
-                    origin *= 0.01; // reverse rays and convert to cm (from mm)
-                    dir *= 0.01; //reverse rays and convert to cm (from mm)
+                const AtVector focus_to_lens = focusPoint - lens;
+                const AtVector dir_unperturbed = AiV3Normalize(focus_to_lens);
+                const float inv_focus_to_lens_length = 1.0 / AiV3Length(focus_to_lens);
+                AtVector dv_dsx = dfocus_dsx - dlens_dsx;
+                AtVector dv_dsy = dfocus_dsy - dlens_dsy;
+                derivs->dDdsx = (dv_dsx - dir_unperturbed * AiV3Dot(dir_unperturbed, dv_dsx)) * inv_focus_to_lens_length;
+                derivs->dDdsy = (dv_dsy - dir_unperturbed * AiV3Dot(dir_unperturbed, dv_dsy)) * inv_focus_to_lens_length;
+
+                // coma rotates the direction about an axis orthogonal to it (see abb_coma_perturb()), which gives
+                // dir = v cos(angle) + w sin(angle), with w the unit vector orthogonal to v towards the optical axis.
+                // the angle depends on the field position and the lens sample through abb_coma_multipliers(), so both terms are differentiated
+                if (abb_coma_multiplied != 0.0){
+                    const AtVector optical_axis(0.0, 0.0, -1.0);
+                    const float degrees_to_angle = 2.3456 * AI_PI / 180.0;
+                    const float angle = abb_coma_multiplied * degrees_to_angle;
+                    const float cos_v = AiV3Dot(dir_unperturbed, optical_axis);
+                    const float sin_v = std::sqrt(std::max(1.0f - cos_v*cos_v, 1e-12f));
+                    const AtVector w = (optical_axis - dir_unperturbed * cos_v) / sin_v;
+
+                    // abb_coma_multipliers() is linear in the projection of dir_from_center on the optical axis
+                    const float maximal_projection = AiV3Dot(AiV3Normalize(AtVector(sensor_width*0.5, sensor_width*0.5, -focal_length)), optical_axis);
+                    const float dangle_dprojection = -abb_coma * unit_disk.norm() * 2.0 / (1.0 - maximal_projection) * degrees_to_angle;
+                    const float inv_p_length = 1.0 / AiV3Length(p);
+                    // and linear in the distance of the lens sample to the center of the aperture
+                    const float unit_disk_norm_squared = unit_disk.squaredNorm();
+                    const AtVector unit_disk_direction(unit_disk(0), unit_disk(1), 0.0);
+
+                    auto coma_derivative = [&](const AtVector &dv, const AtVector &ds, const AtVector &dlens) {
+                        const AtVector dp = ds * (sensor_width*0.5);
+                        const AtVector dcenter = (dp - dir_from_center * AiV3Dot(dir_from_center, dp)) * inv_p_length;
+                        float dangle = dangle_dprojection * AiV3Dot(dcenter, optical_axis);
+                        if (unit_disk_norm_squared > 0.0) dangle += angle * AiV3Dot(unit_disk_direction, dlens) / (aperture_radius * unit_disk_norm_squared);
+                        const float dcos_v = AiV3Dot(dv, optical_axis);
+                        const AtVector dw = (-dv * cos_v - dir_unperturbed * dcos_v) / sin_v + w * (cos_v * dcos_v / (sin_v*sin_v));
+                        return dv * std::cos(angle) + dw * std::sin(angle) + (w * std::cos(angle) - dir_unperturbed * std::sin(angle)) * dangle;
+                    };
+                    derivs->dDdsx = coma_derivative(derivs->dDdsx, ds_dsx, dlens_dsx);
+                    derivs->dDdsy = coma_derivative(derivs->dDdsy, ds_dsy, dlens_dsy);
                 }
+                derivs->dOdsx = dlens_dsx * unit_scale;
+                derivs->dOdsy = dlens_dsy * unit_scale;
             }
 
+            // convert to scene units (from cm)
+            origin = lens * unit_scale;
+            dir = dir_from_lens * unit_scale;
            
             // weight = AI_RGB_WHITE;
             ray_succes = true;
@@ -569,95 +961,643 @@ public:
     }
 
 
-    // given camera space scene point, return point on sensor
+    inline void trace_ray_fw(int &tries,
+                             const double sx, const double sy,
+                             AtVector &origin, AtVector &direction, AtRGB &weight,
+                             double &r1, double &r2, RayDerivatives *derivs)
+    {
+        (this->*trace_ray_fw_kernel)(tries, sx, sy, origin, direction, weight, r1, r2, derivs);
+    }
+
+
+    // Checks the analytic ray derivatives of the forward kernels against central finite differences of the same kernel,
+    // and compares the ray throughput with the forward finite differences they replace (three rays without derivatives).
+    // thin lens: with and without distortion and coma, and with analytic or atlas vignetting. polynomial optics: with and without dof.
+    // Only runs when LENTIL_CHECK_DERIVATIVES is set, after the camera setup.
+    void check_ray_derivatives() {
+        if (!std::getenv("LENTIL_CHECK_DERIVATIVES")) return;
+
+        if (cameraType == PolynomialOptics) {
+            switch (outer_pupil_geometry){
+                case pupil_cyl_y: { check_ray_derivatives_po<pupil_cyl_y>(); } break;
+                case pupil_cyl_x: { check_ray_derivatives_po<pupil_cyl_x>(); } break;
+                default: { check_ray_derivatives_po<pupil_sphere>(); }
+            }
+            return;
+        }
+
+        // the thin lens kernels read the aberrations from the camera, the user's values are put back afterwards
+        const float user_coma = abb_coma;
+        const float user_distortion = abb_distortion;
+        for (int coma = 0; coma < 2; ++coma) {
+            for (int distortion = 0; distortion < 2; ++distortion) {
+                abb_coma = coma ? (user_coma > 0.0 ? user_coma : 1.0) : 0.0;
+                abb_distortion = distortion ? (user_distortion > 0.0 ? user_distortion : 0.1) : 0.0;
+                const std::string name = std::string("thin lens") + (distortion ? ", distortion" : "") + (coma ? ", coma" : "");
+                check_ray_derivatives_kernel(name.c_str(), distortion ? &Camera::trace_ray_fw_thinlens<true, aperture_disk, true, vignetting_none>
+                                                                      : &Camera::trace_ray_fw_thinlens<true, aperture_disk, false, vignetting_none>);
+            }
+        }
+        abb_coma = user_coma;
+        abb_distortion = user_distortion;
+
+        // analytic vignetting is only selected without coma and distortion, the atlas only exists when it was selected
+        const float user_vignetting_distance = optical_vignetting_distance;
+        if (optical_vignetting_distance <= 0.0) optical_vignetting_distance = 5.0;
+        abb_coma = abb_distortion = 0.0;
+        check_ray_derivatives_kernel("thin lens, analytic vignetting", &Camera::trace_ray_fw_thinlens<true, aperture_disk, false, vignetting_analytic>);
+        abb_coma = user_coma;
+        abb_distortion = user_distortion;
+        optical_vignetting_distance = user_vignetting_distance;
+        if (optical_vignetting_sampling == vignetting_atlas) {
+            check_ray_derivatives_kernel("thin lens, vignetting atlas", abb_distortion != 0.0 ? &Camera::trace_ray_fw_thinlens<true, aperture_disk, true, vignetting_atlas>
+                                                                                            : &Camera::trace_ray_fw_thinlens<true, aperture_disk, false, vignetting_atlas>);
+        }
+    }
+
+    template<PupilGeometry OuterPupil>
+    void check_ray_derivatives_po() {
+        check_ray_derivatives_kernel("polynomial optics", &Camera::trace_ray_fw_po<false, aperture_disk, OuterPupil, false>);
+        // the dof kernel samples through the aperture atlas, which only exists with dof enabled
+        if (enable_dof && aperture_shape != aperture_image) {
+            check_ray_derivatives_kernel("polynomial optics, dof", &Camera::trace_ray_fw_po<true, aperture_disk, OuterPupil, false>);
+        }
+    }
+
+    void check_ray_derivatives_kernel(const char *name, TraceRayFwKernel kernel) {
+        const double h = 1e-4;
+        const double extent_y = static_cast<double>(yres_without_region) / std::max(static_cast<double>(xres_without_region), 1.0);
+        const double lens_samples[4][2] = {{0.2, 0.3}, {0.7, 0.4}, {0.45, 0.8}, {0.5, 0.5}};
+
+        // a ray only counts when the first lens sample made it through, retries draw a sample of their own
+        auto trace = [&](const double sx, const double sy, const double r1_in, const double r2_in, AtVector &origin, AtVector &direction, RayDerivatives *derivs) {
+            int tries = 0;
+            double r1 = r1_in, r2 = r2_in;
+            AtRGB weight = AI_RGB_WHITE;
+            (this->*kernel)(tries, sx, sy, origin, direction, weight, r1, r2, derivs);
+            return tries == 0 && weight.r + weight.g + weight.b > 0.0f;
+        };
+        auto relative_error = [](const AtVector &analytic, const AtVector &finite) {
+            return AiV3Length(analytic - finite) / std::max(std::max(AiV3Length(analytic), AiV3Length(finite)), 1e-6f);
+        };
+
+        double max_error = 0.0;
+        int rays = 0;
+        for (int j = 0; j < 9; ++j) {
+            for (int i = 0; i < 9; ++i) {
+                const double sx = -0.9 + 1.8 * i / 8.0;
+                const double sy = (-0.9 + 1.8 * j / 8.0) * extent_y;
+                for (const auto &lens : lens_samples) {
+                    AtVector origin, direction, o[4], d[4];
+                    RayDerivatives derivs;
+                    if (!trace(sx, sy, lens[0], lens[1], origin, direction, &derivs) ||
+                        !trace(sx + h, sy, lens[0], lens[1], o[0], d[0], nullptr) || !trace(sx - h, sy, lens[0], lens[1], o[1], d[1], nullptr) ||
+                        !trace(sx, sy + h, lens[0], lens[1], o[2], d[2], nullptr) || !trace(sx, sy - h, lens[0], lens[1], o[3], d[3], nullptr)) continue;
+
+                    max_error = std::max(max_error, static_cast<double>(relative_error(derivs.dOdsx, (o[0] - o[1]) / (2.0 * h))));
+                    max_error = std::max(max_error, static_cast<double>(relative_error(derivs.dOdsy, (o[2] - o[3]) / (2.0 * h))));
+                    max_error = std::max(max_error, static_cast<double>(relative_error(derivs.dDdsx, (d[0] - d[1]) / (2.0 * h))));
+                    max_error = std::max(max_error, static_cast<double>(relative_error(derivs.dDdsy, (d[2] - d[3]) / (2.0 * h))));
+                    ++rays;
+                }
+            }
+        }
+
+        // throughput: one ray with analytic derivatives against the finite differences camera_create_ray used before,
+        // three rays without derivatives (the ray and one step in sx and sy) and the forward differences between them
+        const int timed_rays = 100000;
+        AtVector origin, direction, o[2], d[2];
+        RayDerivatives derivs;
+        auto time_rays = [&](const bool finite_differences) {
+            const auto time_start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < timed_rays; ++i) {
+                const double sx = -0.9 + 1.8 * ((i * 7919) % 1000) / 1000.0;
+                const double sy = (-0.9 + 1.8 * ((i * 104729) % 1000) / 1000.0) * extent_y;
+                if (!finite_differences) {
+                    trace(sx, sy, 0.3, 0.6, origin, direction, &derivs);
+                    continue;
+                }
+                trace(sx, sy, 0.3, 0.6, origin, direction, nullptr);
+                trace(sx + h, sy, 0.3, 0.6, o[0], d[0], nullptr);
+                trace(sx, sy + h, 0.3, 0.6, o[1], d[1], nullptr);
+                derivs.dOdsx = (o[0] - origin) / h; derivs.dDdsx = (d[0] - direction) / h;
+                derivs.dOdsy = (o[1] - origin) / h; derivs.dDdsy = (d[1] - direction) / h;
+            }
+            return timed_rays / std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - time_start).count() * 1e-6;
+        };
+        const double analytic_rate = time_rays(false);
+        const double finite_rate = time_rays(true);
+
+        if (max_error > 1e-2) {
+            AiMsgWarning("[LENTIL CAMERA] ray derivatives (%s): max relative error %.2e against finite differences over %d rays", name, max_error, rays);
+        }
+        AiMsgInfo("[LENTIL CAMERA] ray derivatives (%s): max relative error %.2e over %d rays, %.2f Mrays/s analytic, %.2f Mrays/s with finite differences",
+                  name, max_error, rays, analytic_rate, finite_rate);
+    }
+
+
+    // given camera space scene point, return the pixels it lands on, one for each wavelength.
+    // all wavelengths share the aperture sample and the occlusion probe, only the lens solve is done per wavelength.
+    // transmitted tells which of the wavelengths made it through the lens and into the frame, returns false when none did.
+    // the lens side rejections are cheap compared to the shadow ray, so the probe is only traced for rays that passed them.
+    // only used for bidirectional sampling, which is always done with depth of field enabled
+    template<ApertureShape Shape, int Wavelengths>
     inline bool trace_ray_bw_po(Eigen::Vector3d target,
-                                Eigen::Vector2d &sensor_position,
-                                const int px, 
-                                const int py,
+                                const double (&wavelengths)[Wavelengths],
+                                unsigned (&pixelnumbers)[Wavelengths],
+                                bool (&transmitted)[Wavelengths],
+                                const unsigned int sampling_seed,
                                 const int total_samples_taken,
-                                AtMatrix cam_to_world,
+                                const AtMatrix &cam_to_world,
                                 AtVector sample_pos_ws,
                                 AtShaderGlobals *sg, 
-                                float lambda_in,
-                                bool sample_is_from_skydome)
+                                bool sample_is_from_skydome,
+                                const int bokeh_level,
+                                ApertureVisibilityCache &visibility)
     {
         int tries = 0;
         bool ray_succes = false;
 
         // initialize 5d light fields
-        Eigen::VectorXd sensor(5); sensor << 0,0,0,0, lambda_in;
-        Eigen::VectorXd out(5); out << 0,0,0,0, lambda_in;//out.setZero();
+        Eigen::VectorXd sensor(5); sensor.setZero();
+        Eigen::VectorXd out(5); out.setZero();
         Eigen::Vector2d aperture(0,0);
+
+        // raytrace for scene/geometrical occlusions between the sample and a point on the unit aperture
+        auto probe = [&](const double x, const double y) {
+            AtVector lens_correct_scaled = AtVector(-x*aperture_radius*0.1, -y*aperture_radius*0.1, 0.0) * unit_scale;
+            AtVector cam_pos_ws = AiM4PointByMatrixMult(cam_to_world, lens_correct_scaled);
+            AtVector ws_direction = AiV3Normalize(cam_pos_ws - sample_pos_ws);
+            AtRay ray = AiMakeRay(AI_RAY_SHADOW, sample_pos_ws, &ws_direction, AiV3Dist(cam_pos_ws, sample_pos_ws), sg);
+            return !AiTraceProbe(ray, sg);
+        };
         
         while(ray_succes == false && tries <= vignetting_retries){
 
             Eigen::Vector2d unit_disk(0.0, 0.0);
 
-            if (!enable_dof) aperture(0) = aperture(1) = 0.0; // no dof, all rays through single aperture point
-            else if (enable_dof && bokeh_aperture_blades <= 2) {
-                unsigned int seed = tea<8>(px*py+px, total_samples_taken+tries);
+            // the first try takes the next point of the source sample's pattern, every retry gets a pattern of its own
+            const unsigned int seed = tries == 0 ? sampling_seed : pattern_seed(sampling_seed, 16 + tries);
+
+            if constexpr (Shape == aperture_image) {
+                const unsigned int strata_seed = pattern_seed(seed, 1);
+                image.bokehSample(sobol_owen(total_samples_taken, 0, seed), sobol_owen(total_samples_taken, 1, seed), unit_disk,
+                                  sobol_owen(total_samples_taken, 0, strata_seed), sobol_owen(total_samples_taken, 1, strata_seed), bokeh_level);
+            } else {
+                // plain rejection sampling: the atlas is built for sensor positions at the focus distance,
+                // a defocused scene point sees a different transmitting region than its pinhole projection
+                aperture_sampler.sample<Shape>(sobol_owen(total_samples_taken, 0, seed), sobol_owen(total_samples_taken, 1, seed), unit_disk);
+            }
 
-                if (bokeh_enable_image) image.bokehSample(rng(seed), rng(seed), unit_disk, rng(seed), rng(seed));
-                else concentric_disk_sample(rng(seed), rng(seed), unit_disk, true);
+            aperture(0) = unit_disk(0) * aperture_radius;
+            aperture(1) = unit_disk(1) * aperture_radius;
 
-                aperture(0) = unit_disk(0) * aperture_radius;
-                aperture(1) = unit_disk(1) * aperture_radius;
-            } 
-            else if (enable_dof && bokeh_aperture_blades > 2) {
-                unsigned int seed = tea<8>(px*py+px, total_samples_taken+tries);
-                lens_sample_triangular_aperture(aperture(0), aperture(1), rng(seed), rng(seed), aperture_radius, bokeh_aperture_blades);
+            for (int w = 0; w < Wavelengths; ++w) {
+                transmitted[w] = false;
+                sensor.setZero();
+                sensor(4) = wavelengths[w];
+                out.setZero();
+                out(4) = wavelengths[w];
+
+                if(lens_lt_sample_aperture(target, aperture, sensor, out, wavelengths[w]) <= 0) continue;
+
+                // crop at inward facing pupil, not needed to crop by outgoing because already done in lens_lt_sample_aperture()
+                const double px = sensor(0) + sensor(2) * lens_back_focal_length;
+                const double py = sensor(1) + sensor(3) * lens_back_focal_length; //(note that lens_focal_length is the back focal length, i.e. the distance unshifted sensor -> pupil)
+                if (px*px + py*py > lens_inner_pupil_radius*lens_inner_pupil_radius) continue;
+
+                // shift sensor
+                const double sensor_x = sensor(0) + sensor(2) * -sensor_shift;
+                const double sensor_y = sensor(1) + sensor(3) * -sensor_shift;
+
+                double pixel_x = 0.0, pixel_y = 0.0;
+                if (!sensor_to_pixel(sensor_x / (sensor_width * 0.5), sensor_y / (sensor_width * 0.5), pixel_x, pixel_y)) continue;
+                pixelnumbers[w] = coords_to_linear_pixel(floor(pixel_x), floor(pixel_y));
+                transmitted[w] = true;
+                ray_succes = true;
             }
 
+            // the skydome can't be occluded
+            if (ray_succes && !sample_is_from_skydome && !visibility.visible(unit_disk(0), unit_disk(1), probe)) ray_succes = false;
+
+            if (!ray_succes) ++tries;
+        }
+
+        return ray_succes;
+    }
+
+
+    // screen space sensor position to pixel position in the (region) buffers, false when outside of frame
+    inline bool sensor_to_pixel(const double sx, const double sy, double &pixel_x, double &pixel_y){
+        pixel_x = ((( sx + 1.0) / 2.0) * xres_without_region) - region_min_x;
+        pixel_y = (((-sy * frame_aspect_ratio_without_region + 1.0) / 2.0) * yres_without_region) - region_min_y;
+
+        return !((pixel_x >= xres) || (pixel_x < 0) || (pixel_y >= yres) || (pixel_y < 0) ||
+                 (pixel_x != pixel_x) || (pixel_y != pixel_y)); // nan checking
+    }
+
+
+    // screen space position of a point on the unit aperture, through an affine footprint
+    inline bool footprint_to_pixel(const FootprintTransform &footprint, const double x, const double y, double &pixel_x, double &pixel_y){
+        const AtVector2 screen = footprint.origin + footprint.axis_x * x + footprint.axis_y * y;
+        return sensor_to_pixel(screen.x, screen.y, pixel_x, pixel_y);
+    }
+
+    // bounding box of the footprint of the whole unit square against the frame/region.
+    // slightly enlarged, bokeh images with an even size reach half a texel past the unit square
+    inline FootprintCoverage footprint_in_frame(const FootprintTransform &footprint){
+        const double extent_x = 1.1 * (std::abs(footprint.axis_x.x) + std::abs(footprint.axis_y.x));
+        const double extent_y = 1.1 * (std::abs(footprint.axis_x.y) + std::abs(footprint.axis_y.y));
+
+        double min_x = 0.0, min_y = 0.0, max_x = 0.0, max_y = 0.0;
+        sensor_to_pixel(footprint.origin.x - extent_x, footprint.origin.y + extent_y, min_x, min_y);
+        sensor_to_pixel(footprint.origin.x + extent_x, footprint.origin.y - extent_y, max_x, max_y);
+
+        if (!(max_x >= 0.0 && min_x < xres && max_y >= 0.0 && min_y < yres)) return footprint_outside; // nan ends up outside as well
+        if (min_x >= 0.0 && max_x < xres && min_y >= 0.0 && max_y < yres) return footprint_inside;
+        return footprint_partial;
+    }
+
+
+    inline void splat_to_buffers(const unsigned pixelnumber, const RedistributionSample &rs,
+                                 std::vector<std::map<float, float>> &crypto_cache, std::vector<AtRGBA> &aov_values,
+                                 const AtRGB rgb_weight, const float splat_weight = 1.0f)
+    {
+        // box filtering for now, couldn't get gaussian filtering to work yet
+        const float filter_weight = splat_weight;
 
-            // raytrace for scene/geometrical occlusions along the ray
-            AtVector lens_correct_scaled = AtVector(-aperture(0)*0.1, -aperture(1)*0.1, 0.0);
-            switch (unitModel){
-                case mm: { lens_correct_scaled /= 0.1; } break;
-                case cm: { lens_correct_scaled /= 1.0; } break;
-                case dm: { lens_correct_scaled /= 10.0;} break;
-                case m:  { lens_correct_scaled /= 100.0;}
+        if (rs.convergence_batch) {
+            const float deposited = (rgb_weight.r + rgb_weight.g + rgb_weight.b) / 3.0f * splat_weight * rs.inverse_sample_density * rs.inv_samples;
+            splat_convergence.deposit(*rs.convergence_batch, pixelnumber % xres, pixelnumber / xres, deposited);
+        }
+
+        for (auto &aov : aovs){
+            if (aov.is_crypto) add_to_buffer_cryptomatte(aov, pixelnumber, crypto_cache[aov.index], splat_weight * rs.inverse_sample_density * rs.inv_samples);
+            else add_to_buffer(aov, pixelnumber, aov_values[aov.index], rs.fitted_bidir_add_energy, rs.depth, rs.iterator, filter_weight * rs.inverse_sample_density * rs.inv_samples, rgb_weight); 
+        }
+    }
+
+
+    // At high AA many samples of a pixel hit practically the same point with the same colour, and would each splat
+    // the same bokeh shape. A sample joins the first cluster of its pixel that is within tolerance in depth (relative),
+    // colour (relative to the brightest channel), subpixel position (relative to the circle of confusion) and time
+    // (relative to the shutter), otherwise it starts a new one.
+    // The splat count of a cluster comes from the summed demand of its members, so the total stays the same
+    // but the per source overhead and the clamp to the minimum count are paid once.
+    void cluster_redistribution_sample(std::vector<RedistributionCluster> &clusters, const RedistributionSample &rs,
+                                       const std::vector<std::map<float, float>> &crypto_cache, const std::vector<AtRGBA> &aov_values,
+                                       const AtRGBA colour, const AtVector2 offset, const float time, const float coc_radius,
+                                       const float splat_demand, const float luminance, const int sampleid)
+    {
+        const float tolerance = bidir_cluster_tolerance;
+        const float shutter_length = time_end - time_start;
+
+        for (auto &cluster : clusters) {
+            if (cluster.rs.is_from_skydome != rs.is_from_skydome || cluster.rs.bokeh_level != rs.bokeh_level) continue;
+            if (std::abs(cluster.rs.depth - rs.depth) > tolerance * std::min(std::abs(cluster.rs.depth), std::abs(rs.depth))) continue;
+
+            const float brightness = std::max(std::max(AiColorMaxRGB(cluster.colour), AiColorMaxRGB(colour)), 1e-3f);
+            const float colour_difference = std::max(std::max(std::abs(cluster.colour.r - colour.r), std::abs(cluster.colour.g - colour.g)), std::abs(cluster.colour.b - colour.b));
+            if (colour_difference > tolerance * brightness) continue;
+
+            const float max_distance = tolerance * std::min(cluster.coc_radius, coc_radius);
+            const float dx = cluster.offset.x - offset.x;
+            const float dy = cluster.offset.y - offset.y;
+            if (dx*dx + dy*dy > max_distance*max_distance) continue;
+            if (std::abs(cluster.time - time) > tolerance * shutter_length) continue;
+
+            // share of the new member in the weighted averages
+            const float t = rs.inverse_sample_density / (cluster.rs.inverse_sample_density + rs.inverse_sample_density);
+            cluster.rs.camera_space_position += (rs.camera_space_position - cluster.rs.camera_space_position) * t;
+            cluster.rs.world_space_position += (rs.world_space_position - cluster.rs.world_space_position) * t;
+            cluster.rs.depth += (rs.depth - cluster.rs.depth) * t;
+            cluster.rs.fitted_bidir_add_energy += (rs.fitted_bidir_add_energy - cluster.rs.fitted_bidir_add_energy) * t;
+            cluster.rs.inverse_sample_density += rs.inverse_sample_density;
+            cluster.luminance += (luminance - cluster.luminance) * t;
+            cluster.splat_demand += splat_demand;
+            cluster.rs.samples = clamp(static_cast<int>(std::ceil(cluster.splat_demand)), 4, 2000);
+
+            for (auto &aov : aovs) {
+                if (aov.is_crypto) {
+                    // ids only one side has count as zero coverage on the other
+                    for (auto &id : cluster.crypto_cache[aov.index]) id.second *= (1.0f - t);
+                    for (auto const& id : crypto_cache[aov.index]) cluster.crypto_cache[aov.index][id.first] += id.second * t;
+                }
+                else cluster.aov_values[aov.index] += (aov_values[aov.index] - cluster.aov_values[aov.index]) * t;
             }
-            AtVector cam_pos_ws = AiM4PointByMatrixMult(cam_to_world, lens_correct_scaled);
-            AtVector ws_direction = AiV3Normalize(cam_pos_ws - sample_pos_ws);
-            AtRay ray = AiMakeRay(AI_RAY_SHADOW, sample_pos_ws, &ws_direction, AiV3Dist(cam_pos_ws, sample_pos_ws), sg);
-            AtScrSample hit = AtScrSample();
+            return;
+        }
+
+        clusters.push_back({rs, crypto_cache, aov_values, colour, offset, time, coc_radius, splat_demand, luminance, sampleid});
+        clusters.back().rs.samples = clamp(static_cast<int>(std::ceil(splat_demand)), 4, 2000);
+    }
+
+
+    // backward redistribution kernels, one instantiation per camera configuration.
+    // picked once in setup_filter() through select_redistribution_kernel().
+    template<ApertureShape Shape, bool Chromatic>
+    void redistribute_po(const RedistributionSample &rs,
+                         std::vector<std::map<float, float>> &crypto_cache,
+                         std::vector<AtRGBA> &aov_values)
+    {
+        // sample can't be inside of lens
+        if (std::abs(rs.camera_space_position.z) < (lens_length*0.1)) {
+            filter_and_add_to_buffer_new(rs.px, rs.py, rs.depth, rs.iterator, crypto_cache, aov_values, rs.inverse_sample_density);
+            return;
+        }
+
+        const Eigen::Vector3d camera_space_sample_position_eigen(rs.camera_space_position.x, rs.camera_space_position.y, rs.camera_space_position.z);
+        unsigned int total_samples_taken = 0;
+        const unsigned int max_total_samples = rs.samples*5;
+
+        // with chromatic aberration every splat carries 4 hero wavelengths, stratified over the visible range.
+        // the hero wavelengths come from their own sobol pattern of the source sample.
+        constexpr int wavelength_count = Chromatic ? 4 : 1;
+        const unsigned int wavelength_seed = pattern_seed(rs.sampling_seed, 2);
+        ApertureVisibilityCache visibility(bidir_visibility_cache && rs.samples >= ApertureVisibilityCache::min_splats);
+
+        for(int count=0; count<rs.samples && total_samples_taken < max_total_samples; ++count, ++total_samples_taken) {
+            if (render_interrupted_at(total_samples_taken)) break;
             
-            if (AiTraceProbe(ray, sg) && !sample_is_from_skydome){
-            // if (AiTrace(ray, AI_RGB_WHITE, hit) && !sample_is_from_skydome){
-                ++tries;
+            double wavelengths[wavelength_count] = {lambda};
+            AtRGB rgb_weights[wavelength_count] = {AI_RGB_WHITE};
+            if constexpr (Chromatic) {
+                double hero[wavelength_count];
+                SpectralToRgb::hero_wavelengths<wavelength_count>(sobol_owen(total_samples_taken, 0, wavelength_seed), hero);
+                for (int w = 0; w < wavelength_count; ++w) {
+                    wavelengths[w] = chromatic_lens_wavelength(hero[w]);
+                    rgb_weights[w] = spectral_to_rgb(hero[w]);
+                }
+            }
+
+            unsigned pixelnumbers[wavelength_count];
+            bool transmitted[wavelength_count];
+            if(!trace_ray_bw_po<Shape, wavelength_count>(-camera_space_sample_position_eigen*10.0, wavelengths, pixelnumbers, transmitted, rs.sampling_seed, total_samples_taken, rs.cam_to_world, rs.world_space_position, rs.sg, rs.is_from_skydome, rs.bokeh_level, visibility)) {
+                --count;
                 continue;
             }
 
-            sensor(0) = sensor(1) = 0.0;
+            // every wavelength carries its share of the splat, so a source adds up to rs.samples splats of filter (and cryptomatte)
+            // weight like the thin lens kernel. The spectral weights average to white over the wavelengths of a splat
+            for (int w = 0; w < wavelength_count; ++w) {
+                if (transmitted[w]) splat_to_buffers(pixelnumbers[w], rs, crypto_cache, aov_values, rgb_weights[w], 1.0f / wavelength_count);
+            }
+        }
 
-            float transmittance = lens_lt_sample_aperture(target, aperture, sensor, out, lambda_in);
-            if(transmittance <= 0) {
-                ++tries;
-                continue;
+        visibility_stats.add(visibility);
+    }
+
+
+    template<ApertureShape Shape, bool Chromatic, ChromaticType ChromaticShift, bool Distortion, OpticalVignettingSampling Vignetting>
+    void redistribute_thinlens(const RedistributionSample &rs,
+                               std::vector<std::map<float, float>> &crypto_cache,
+                               std::vector<AtRGBA> &aov_values)
+    {
+        const AtVector &camera_space_sample_position = rs.camera_space_position;
+        const float image_dist_samplepos = (-focal_length * camera_space_sample_position.z) / (-focal_length + camera_space_sample_position.z);
+        const float image_dist_focusdist = get_image_dist_focusdist_thinlens();
+        unsigned int total_samples_taken = 0;
+
+        // with chromatic aberration every aperture sample is deposited for all channel groups, so a third
+        // of the aperture samples gives every channel as many samples as the old random channel pick did.
+        // splat_weight keeps the total weight of the source sample at rs.samples splats.
+        constexpr int groups = chromatic_group_count<Chromatic, ChromaticShift>();
+        const int aperture_samples = Chromatic ? std::max((rs.samples + 2) / 3, 1) : rs.samples;
+        const float splat_weight = static_cast<float>(rs.samples) / static_cast<float>(aperture_samples * groups);
+        unsigned int max_total_samples = aperture_samples*5;
+
+        // seen from the lens, the second aperture is a disk centered at k/(1+k) * P, with k = distance ratio.
+        // this is exactly the region the vignetting test below accepts, like in the forward path
+        const double vignetting_k = optical_vignetting_distance / std::abs(camera_space_sample_position.z);
+        const Eigen::Vector2d vignetting_center(camera_space_sample_position.x * vignetting_k/(1.0+vignetting_k), camera_space_sample_position.y * vignetting_k/(1.0+vignetting_k));
+        const double vignetting_radius = aperture_radius*optical_vignetting_radius/(1.0+vignetting_k);
+
+        // point index of the source sample's sobol pattern on the unit aperture (anamorphic squeeze included),
+        // false when the aperture is fully vignetted
+        auto sample_aperture = [&](const unsigned int index, Eigen::Vector2d &unit_disk) {
+            const float r1 = sobol_owen(index, 0, rs.sampling_seed);
+            const float r2 = sobol_owen(index, 1, rs.sampling_seed);
+
+            // either get uniformly distributed points on the unit disk or bokeh image
+            if constexpr (Vignetting == vignetting_analytic) {
+                Eigen::Vector2d lens_sample(0, 0);
+                if (!sample_disk_intersection(r1, r2, aperture_radius, vignetting_center, vignetting_radius, lens_sample)) return false;
+                unit_disk = lens_sample / aperture_radius;
+            }
+            else if constexpr (Shape == aperture_image) {
+                const unsigned int strata_seed = pattern_seed(rs.sampling_seed, 1);
+                image.bokehSample(r1, r2, unit_disk, sobol_owen(index, 0, strata_seed), sobol_owen(index, 1, strata_seed), rs.bokeh_level);
             }
+            else aperture_sampler.sample<Shape>(r1, r2, unit_disk);
 
-            // crop at inward facing pupil, not needed to crop by outgoing because already done in lens_lt_sample_aperture()
-            const double px = sensor(0) + sensor(2) * lens_back_focal_length;
-            const double py = sensor(1) + sensor(3) * lens_back_focal_length; //(note that lens_focal_length is the back focal length, i.e. the distance unshifted sensor -> pupil)
-            if (px*px + py*py > lens_inner_pupil_radius*lens_inner_pupil_radius) {
-                ++tries;
-                continue;
+            unit_disk(0) *= bokeh_anamorphic;
+            return true;
+        };
+
+        // Without coma, distortion and chromatic aberration the sensor position is an affine function of the lens position,
+        // so the footprint of the source (its circle of confusion) is known before any splat is made.
+        // Sources landing completely outside of the frame/region are dropped, partially visible ones reject the part of the
+        // aperture that lands out of frame before any of the work below. The splats in frame keep the full weight of the
+        // source, like in every other kernel that rejects them further down.
+        FootprintTransform footprint;
+        bool cull_footprint = false;
+        if constexpr (!Chromatic && !Distortion) {
+            if (abb_coma == 0.0) {
+                const AtVector dir_from_center = AiV3Normalize(camera_space_sample_position);
+                const AtVector samplepos_image_point = dir_from_center * std::abs(image_dist_samplepos/dir_from_center.z);
+                auto lens_to_screen = [&](const double x, const double y) {
+                    const AtVector lens(x * aperture_radius, y * aperture_radius, 0.0);
+                    const AtVector dir_from_lens_to_image_sample = AiV3Normalize(samplepos_image_point - lens);
+                    const AtVector focusdist_image_point = lens + dir_from_lens_to_image_sample*std::abs(image_dist_focusdist/dir_from_lens_to_image_sample.z);
+                    return AtVector2(focusdist_image_point.x / focusdist_image_point.z, focusdist_image_point.y / focusdist_image_point.z) / ((sensor_width*0.5)/-focal_length);
+                };
+                footprint.origin = lens_to_screen(0.0, 0.0);
+                footprint.axis_x = lens_to_screen(1.0, 0.0) - footprint.origin;
+                footprint.axis_y = lens_to_screen(0.0, 1.0) - footprint.origin;
+
+                switch (footprint_in_frame(footprint)) {
+                    case footprint_outside: return;
+                    case footprint_inside: break;
+                    case footprint_partial: {
+                        // the first points of the pattern estimate the covered fraction, which sizes the attempt budget
+                        const unsigned int estimate_samples = 256;
+                        unsigned int covered = 0;
+                        for (unsigned int i = 0; i < estimate_samples; ++i) {
+                            Eigen::Vector2d unit_disk(0, 0);
+                            if (!sample_aperture(i, unit_disk)) return; // fully vignetted
+                            double pixel_x = 0.0, pixel_y = 0.0;
+                            if (footprint_to_pixel(footprint, unit_disk(0), unit_disk(1), pixel_x, pixel_y)) ++covered;
+                        }
+                        if (covered == 0) return;
+
+                        const float in_frame_fraction = static_cast<float>(covered) / estimate_samples;
+                        max_total_samples = std::ceil(max_total_samples / in_frame_fraction);
+                        cull_footprint = true;
+                    } break;
+                }
             }
+        }
 
-            ray_succes = true;
+        // raytrace for scene/geometrical occlusions between the sample and a point on the unit aperture
+        ApertureVisibilityCache visibility(bidir_visibility_cache && aperture_samples >= ApertureVisibilityCache::min_splats);
+        auto probe = [&](const double x, const double y) {
+            AtVector lens_correct_scaled = AtVector(x * aperture_radius, y * aperture_radius, 0.0) * unit_scale;
+            AtVector cam_pos_ws = AiM4PointByMatrixMult(rs.cam_to_world, lens_correct_scaled);
+            AtVector ws_direction = AiV3Normalize(cam_pos_ws - rs.world_space_position);
+            AtRay ray = AiMakeRay(AI_RAY_UNDEFINED, rs.world_space_position, &ws_direction, AiV3Dist(cam_pos_ws, rs.world_space_position), rs.sg);
+            return !AiTraceProbe(ray, rs.sg);
+        };
+
+        for(int count=0; count<aperture_samples && total_samples_taken<max_total_samples; ++count, ++total_samples_taken) {
+            if (render_interrupted_at(total_samples_taken)) break;
+
+            Eigen::Vector2d unit_disk(0, 0);
+            if (!sample_aperture(total_samples_taken, unit_disk)) break; // fully vignetted
+
+            // part of the aperture that lands outside of the frame, rejected before any of the work below
+            if (cull_footprint) {
+                double pixel_x = 0.0, pixel_y = 0.0;
+                if (!footprint_to_pixel(footprint, unit_disk(0), unit_disk(1), pixel_x, pixel_y)) {
+                    --count;
+                    continue;
+                }
+            }
+
+            AtVector lens(unit_disk(0) * aperture_radius, unit_disk(1) * aperture_radius, 0.0);
+
+
+            // ray through center of lens
+            AtVector dir_from_center = AiV3Normalize(camera_space_sample_position);
+            AtVector dir_lens_to_P = AiV3Normalize(camera_space_sample_position - lens);
+
+            // perturb ray direction to simulate coma aberration
+            // todo: the bidirectional case isn't entirely the same as the forward case.. fix!
+            // current strategy is to perturb the initial sample position by doing the same ray perturbation i'm doing in the forward case
+            float abb_coma_multiplied = abb_coma * abb_coma_multipliers(sensor_width, focal_length, dir_from_center, unit_disk);
+            dir_lens_to_P = abb_coma_perturb(dir_lens_to_P, dir_from_center, abb_coma_multiplied, true);
+
+            AtVector camera_space_sample_position_perturbed = AiV3Length(camera_space_sample_position) * dir_lens_to_P;
+            dir_from_center = AiV3Normalize(camera_space_sample_position_perturbed);
+
+            float samplepos_image_intersection = std::abs(image_dist_samplepos/dir_from_center.z);
+            AtVector samplepos_image_point = dir_from_center * samplepos_image_intersection;
+
+
+            // depth of field
+            AtVector dir_from_lens_to_image_sample = AiV3Normalize(samplepos_image_point - lens);
+
+
+            // optical vignetting
+            if constexpr (Vignetting != vignetting_none){
+              dir_lens_to_P = AiV3Normalize(camera_space_sample_position_perturbed - lens);
+              if (!empericalOpticalVignettingSquare(lens, dir_lens_to_P, aperture_radius, optical_vignetting_radius, optical_vignetting_distance, lerp_squircle_mapping(circle_to_square))){
+                  --count;
+                  continue;
+              }
+            }
+
+
+            const float focusdist_intersection = std::abs(image_dist_focusdist/dir_from_lens_to_image_sample.z);
+
+            float chromatic_shift = 0.0;
+            if constexpr (Chromatic) {
+              const float abb_chromatic_lateral = 5.0;
+
+              // calculate sensor point of unperturbed ray for multiplying the chromatic abberation (less in center, more at edges)
+              AtVector focusdist_image_point_uperturbed = lens + dir_from_lens_to_image_sample*focusdist_intersection;
+              AtVector2 sensor_position_unperturbed(focusdist_image_point_uperturbed.x / focusdist_image_point_uperturbed.z,
+                                                    focusdist_image_point_uperturbed.y / focusdist_image_point_uperturbed.z);
+              const float distance_to_center_unperturbed = AiV2Dist(AtVector2(0.0, 0.0), sensor_position_unperturbed);
+              chromatic_shift = abb_chromatic*abb_chromatic_lateral*distance_to_center_unperturbed;
+            }
+
+            unsigned pixelnumbers[groups];
+            bool in_frame[groups];
+            for (int group = 0; group < groups; ++group) {
+              // add some shifting to the focus distance (chromatic abb)
+              float group_focusdist_intersection = focusdist_intersection;
+              if constexpr (Chromatic) {
+                group_focusdist_intersection = std::abs(get_image_dist_focusdist_thinlens_abberated(chromatic_group_shift<ChromaticShift>(group)*chromatic_shift)/dir_from_lens_to_image_sample.z);
+              }
+
+              AtVector focusdist_image_point = lens + dir_from_lens_to_image_sample*group_focusdist_intersection;
+
+
+              // bring back to (x, y, 1)
+              AtVector2 sensor_position(focusdist_image_point.x / focusdist_image_point.z,
+                                        focusdist_image_point.y / focusdist_image_point.z);
+              // transform to screenspace coordinate mapping
+              sensor_position /= (sensor_width*0.5)/-focal_length;
+
+
+              // barrel distortion (inverse)
+              if constexpr (Distortion) sensor_position = inverseBarrelDistortion(AtVector2(sensor_position.x, sensor_position.y), abb_distortion);
+              
+
+              // convert sensor position to pixel position
+              double pixel_x = 0.0, pixel_y = 0.0;
+              in_frame[group] = sensor_to_pixel(sensor_position.x, sensor_position.y, pixel_x, pixel_y);
+              if (in_frame[group]) pixelnumbers[group] = coords_to_linear_pixel(floor(pixel_x), floor(pixel_y));
+            }
+
+            // the shadow ray is only traced once the lens side tests passed, the skydome can't be occluded
+            if (std::none_of(in_frame, in_frame + groups, [](const bool b){ return b; })) {
+              --count;
+              continue;
+            }
+            if (!rs.is_from_skydome && !visibility.visible(unit_disk(0), unit_disk(1), probe)) {
+              --count;
+              continue;
+            }
+
+            // groups landing in the same pixel are merged into a single splat
+            for (int group = 0; group < groups; ++group) {
+              if (!in_frame[group]) continue;
+
+              AtRGB channels = chromatic_group_channels<Chromatic, ChromaticShift>(group);
+              int merged = 1;
+              for (int other = group + 1; other < groups; ++other) {
+                if (!in_frame[other] || pixelnumbers[other] != pixelnumbers[group]) continue;
+                channels += chromatic_group_channels<Chromatic, ChromaticShift>(other);
+                in_frame[other] = false;
+                ++merged;
+              }
+
+              // the rgb weights average to white per unit of splat weight, like the filter weights they are normalized per pixel
+              splat_to_buffers(pixelnumbers[group], rs, crypto_cache, aov_values, channels * (static_cast<float>(groups) / merged), splat_weight * merged);
+            }
         }
 
-        // need to account for the ray_success==false case
-        if (!ray_succes) return false;
+        visibility_stats.add(visibility);
+    }
+
 
-        // shift sensor
-        sensor(0) += sensor(2) * -sensor_shift;
-        sensor(1) += sensor(3) * -sensor_shift;
+    // channel groups of the thin lens chromatic aberration. Every group gets its own focus shift:
+    // green/magenta shifts red and blue the same way so they share a group, red/cyan shifts every channel differently.
+    template<bool Chromatic, ChromaticType ChromaticShift>
+    static constexpr int chromatic_group_count() {
+        return !Chromatic ? 1 : (ChromaticShift == green_magenta ? 2 : 3);
+    }
 
-        sensor_position(0) = sensor(0);
-        sensor_position(1) = sensor(1);
+    // direction of the focus shift, abs(channel) -> green/magenta shift, channel -> red/cyan shift
+    template<ChromaticType ChromaticShift>
+    static inline float chromatic_group_shift(const int group) {
+        return ChromaticShift == green_magenta ? group : group - 1;
+    }
 
-        return true;
+    template<bool Chromatic, ChromaticType ChromaticShift>
+    static inline AtRGB chromatic_group_channels(const int group) {
+        if constexpr (!Chromatic) return AI_RGB_WHITE;
+        else if constexpr (ChromaticShift == green_magenta) return group == 0 ? AtRGB(0,1,0) : AtRGB(1,0,1);
+        else return group == 0 ? AtRGB(1,0,0) : (group == 1 ? AtRGB(0,1,0) : AtRGB(0,0,1));
+    }
+
+
+    inline void redistribute(const RedistributionSample &rs,
+                             std::vector<std::map<float, float>> &crypto_cache,
+                             std::vector<AtRGBA> &aov_values)
+    {
+        (this->*redistribution_kernel)(rs, crypto_cache, aov_values);
     }
 
 
@@ -949,45 +1889,183 @@ public:
         float filter_weight = 1.0;
 
         for (auto &aov : aovs){
-            if (aov.is_crypto) add_to_buffer_cryptomatte(aov, pixelnumber, cryptomatte_cache[aov.index], inv_density);
-            else add_to_buffer(aov, pixelnumber, aov_values[aov.index], 0.0, depth, iterator, filter_weight * inv_density, AI_RGB_WHITE); 
+            if (aov.is_crypto) add_to_buffer_cryptomatte(aov, pixelnumber, cryptomatte_cache[aov.index], inv_density);
+            else add_to_buffer(aov, pixelnumber, aov_values[aov.index], 0.0, depth, iterator, filter_weight * inv_density, AI_RGB_WHITE); 
+        }
+    }
+
+
+    // dim defocused samples are accumulated at their own pixel, the imager blurs them over their circle of confusion.
+    // a pixel is only ever filtered by one thread, so unlike the splats these buffers are written without contention.
+    inline void add_to_gather_buffers(const int px, const int py, const float depth, const float coc_radius_pixels,
+                                      struct AtAOVSampleIterator* iterator,
+                                      std::vector<std::map<float, float>> &cryptomatte_cache, std::vector<AtRGBA> &aov_values, const float inv_density){
+        const unsigned pixelnumber = coords_to_linear_pixel(px, py);
+        gather_weight_buffer[pixelnumber] += inv_density;
+        gather_coc_buffer[pixelnumber] += coc_radius_pixels * inv_density;
+        gather_depth_buffer[pixelnumber] += std::abs(depth) * inv_density;
+        if (!gather_pending.load(std::memory_order_relaxed)) gather_pending.store(true);
+
+        for (auto &aov : aovs){
+            if (aov.is_crypto) add_to_buffer_cryptomatte(aov, pixelnumber, cryptomatte_cache[aov.index], inv_density); // not blurred
+            else if (!aov.gather_buffer.empty()) aov.gather_buffer[pixelnumber] += aov_values[aov.index] * inv_density;
+            else add_to_buffer(aov, pixelnumber, aov_values[aov.index], 0.0, depth, iterator, inv_density, AI_RGB_WHITE);
         }
     }
 
-
-    inline int coords_to_linear_pixel(const int x, const int y) {
-        return x + (y * xres);
+    inline void record_pixel_depth(const int px, const int py, const float depth){
+        float &min_depth = pixel_min_depth_buffer[coords_to_linear_pixel(px, py)];
+        min_depth = std::min(min_depth, std::abs(depth));
     }
 
 
+    // blurs the dim samples of the last pass into the aov buffers, before the imager normalizes them.
+    // the gather buffers are emptied afterwards, so every progressive or IPR pass blurs only what it added on top.
+    // every pixel spreads its dim samples uniformly over its circle of confusion, like the splats would.
+    // This is done as a gather per CoC level: the radius of a pixel is split between the two nearest levels of a geometric
+    // set (0, 1, sqrt(2), 2, ...), every level is a summed area table over the pixels it covers, and its disc is read back
+    // as a stack of rectangles that follow the circle. The cost doesn't depend on the radius, so there is no limit on it.
+    // Rows run in parallel.
+    // depth aware: a pixel nearer than the blurred ones blocks them, unless that pixel is itself blurred far enough to reach them.
+    void resolve_gather_blur() {
+        if (gather_weight_buffer.empty() || !gather_pending.exchange(false)) return;
+
+        const auto time_start = std::chrono::high_resolution_clock::now();
+        const int pixels = xres * yres;
+
+        // continuous level of a radius, level l > 0 has radius 2^((l-1)/2)
+        auto radius_to_level = [](const float radius) {
+            return radius <= 1.0f ? std::max(radius, 0.0f) : 1.0f + 2.0f * std::log2(radius);
+        };
+
+        std::vector<float> source_level(pixels, -1.0f);
+        std::vector<float> source_reach(pixels, 0.0f);
+        float max_level = 0.0f;
+        int blurred_pixels = 0;
+        for (int q = 0; q < pixels; ++q) {
+            const float weight = gather_weight_buffer[q];
+            if (weight <= 0.0f) continue;
+            ++blurred_pixels;
+            source_reach[q] = gather_coc_buffer[q] / weight;
+            source_level[q] = radius_to_level(source_reach[q]);
+            max_level = std::max(max_level, source_level[q]);
+        }
+        if (blurred_pixels == 0) return;
+
+        std::vector<AOVData*> gather_aovs;
+        for (auto &aov : aovs) if (!aov.gather_buffer.empty()) gather_aovs.push_back(&aov);
+
+        SummedAreaTable<2> weight_depth_table;
+        SummedAreaTable<4> aov_table;
+        std::vector<float> level_gain(pixels, 0.0f);
+        const int levels = static_cast<int>(std::ceil(max_level)) + 1;
+
+        for (int level = 0; level < levels; ++level) {
+            // share of a source pixel in this level (tent between the neighbouring levels)
+            auto share = [&](const int q) {
+                return source_level[q] < 0.0f ? 0.0f : std::max(0.0f, 1.0f - std::abs(source_level[q] - level));
+            };
+
+            // bounding box of the sources in this level
+            int min_x = xres, min_y = yres, max_x = -1, max_y = -1;
+            for (int y = 0; y < yres; ++y) {
+                for (int x = 0; x < xres; ++x) {
+                    if (share(coords_to_linear_pixel(x, y)) <= 0.0f) continue;
+                    min_x = std::min(min_x, x); max_x = std::max(max_x, x);
+                    min_y = std::min(min_y, y); max_y = std::max(max_y, y);
+                }
+            }
+            if (max_x < 0) continue;
+
+            // the disc as horizontal bands, each with the width of the circle at its middle row
+            const float radius = level == 0 ? 0.0f : std::pow(2.0f, 0.5f * (level - 1));
+            const int r = static_cast<int>(radius);
+            const int band_count = std::min(2*r + 1, 9);
+            struct Band { int dy0, dy1, half_width; };
+            std::vector<Band> bands;
+            int area = 0;
+            for (int b = 0; b < band_count; ++b) {
+                const int dy0 = -r + (2*r + 1) * b / band_count;
+                const int dy1 = -r + (2*r + 1) * (b + 1) / band_count - 1;
+                const int dy_mid = (dy0 + dy1) / 2;
+                const int half_width = static_cast<int>(std::sqrt(std::max(radius*radius - dy_mid*dy_mid, 0.0f)));
+                bands.push_back({dy0, dy1, half_width});
+                area += (dy1 - dy0 + 1) * (2*half_width + 1); // exact pixel count of the shape, so the blur preserves the energy
+            }
+            const float inv_area = 1.0f / area;
+
+            // the sources, and the pixels they reach
+            const int reach = r + 1;
+            const int target_min_x = std::max(min_x - reach, 0), target_max_x = std::min(max_x + reach, static_cast<int>(xres) - 1);
+            const int target_min_y = std::max(min_y - reach, 0), target_max_y = std::min(max_y + reach, static_cast<int>(yres) - 1);
+
+            weight_depth_table.build(min_x, min_y, max_x - min_x + 1, max_y - min_y + 1, [&](const int x, const int y, double *out){
+                const int q = coords_to_linear_pixel(x, y);
+                out[0] = gather_weight_buffer[q] * share(q);
+                out[1] = gather_depth_buffer[q] * share(q);
+            });
+
+            parallel_for_range(target_max_y - target_min_y + 1, [&](const int row){
+                const int y = target_min_y + row;
+                for (int x = target_min_x; x <= target_max_x; ++x) {
+                    const int p = coords_to_linear_pixel(x, y);
+                    double weight_depth[2] = {0.0, 0.0};
+                    for (const Band &band : bands) weight_depth_table.add_sum(x - band.half_width, y + band.dy0, x + band.half_width, y + band.dy1, weight_depth);
+
+                    level_gain[p] = 0.0f;
+                    if (weight_depth[0] <= 0.0) continue;
+                    const float depth = static_cast<float>(weight_depth[1] / weight_depth[0]);
+                    if (pixel_min_depth_buffer[p] < depth * 0.99f && source_reach[p] < radius) continue;
+
+                    level_gain[p] = inv_area;
+                    filter_weight_buffer[p] += weight_depth[0] * inv_area;
+                }
+            });
+
+            for (AOVData *aov : gather_aovs) {
+                aov_table.build(min_x, min_y, max_x - min_x + 1, max_y - min_y + 1, [&](const int x, const int y, double *out){
+                    const int q = coords_to_linear_pixel(x, y);
+                    const AtRGBA value = aov->gather_buffer[q] * share(q);
+                    out[0] = value.r; out[1] = value.g; out[2] = value.b; out[3] = value.a;
+                });
+
+                parallel_for_range(target_max_y - target_min_y + 1, [&](const int row){
+                    const int y = target_min_y + row;
+                    for (int x = target_min_x; x <= target_max_x; ++x) {
+                        const int p = coords_to_linear_pixel(x, y);
+                        if (level_gain[p] <= 0.0f) continue;
+                        double value[4] = {0.0, 0.0, 0.0, 0.0};
+                        for (const Band &band : bands) aov_table.add_sum(x - band.half_width, y + band.dy0, x + band.half_width, y + band.dy1, value);
+                        aov->buffer[p] += AtRGBA(value[0], value[1], value[2], value[3]) * level_gain[p];
+                    }
+                });
+            }
+        }
 
-    inline void lens_sample_triangular_aperture(double &x, double &y, double r1, double r2, const double radius, const int blades){
-        const int tri = (int)(r1*blades);
+        std::fill(gather_weight_buffer.begin(), gather_weight_buffer.end(), 0.0f);
+        std::fill(gather_coc_buffer.begin(), gather_coc_buffer.end(), 0.0f);
+        std::fill(gather_depth_buffer.begin(), gather_depth_buffer.end(), 0.0f);
+        for (AOVData *aov : gather_aovs) std::fill(aov->gather_buffer.begin(), aov->gather_buffer.end(), AI_RGBA_ZERO);
 
-        // rescale:
-        r1 = r1*blades - tri;
+        const double blur_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - time_start).count();
+        AiMsgInfo("[LENTIL IMAGER] blurred the dim samples of %d pixels over %d coc levels in %.1f ms", blurred_pixels, levels, blur_time);
+    }
 
-        // sample triangle:
-        double a = std::sqrt(r1);
-        double b = (1.0f-r2)*a;
-        double c = r2*a;
 
-        double p1[2], p2[2];
+    inline int coords_to_linear_pixel(const int x, const int y) {
+        return x + (y * xres);
+    }
 
-        common_sincosf(2.0f*AI_PI/blades * (tri+1), p1, p1+1);
-        common_sincosf(2.0f*AI_PI/blades * tri, p2, p2+1);
 
-        x = radius * (b * p1[1] + c * p2[1]);
-        y = radius * (b * p1[0] + c * p2[0]);
-    }
 
+    // the operator is looked up by name first, the universe is only scanned when that fails
+    AtNode *find_lentil_operator(AtUniverse *universe) {
+        if (!lentil_operator_name.empty()) {
+            AtNode *node = AiNodeLookUpByName(universe, lentil_operator_name);
+            if (node && AiNodeEntryGetNameAtString(AiNodeGetNodeEntry(node)) == AtString("lentil_operator")) return node;
+        }
 
-    // the AOV setup is done inside of the operator, which is guaranteed to be
-    // initialized before any other node. Only one lentil_operator is allowed in the scene.
-    // here we just copy some of the data constructed there.
-    void setup_lentil_aovs(AtUniverse *universe) {
         AtNode *lentil_operator_node = nullptr;
-
         AtNodeIterator *iter = AiUniverseGetNodeIterator(universe, AI_NODE_ALL);
         while (!AiNodeIteratorFinished(iter))
         {
@@ -1001,6 +2079,41 @@ public:
         }
         AiNodeIteratorDestroy(iter);
 
+        lentil_operator_name = lentil_operator_node ? AtString(AiNodeGetName(lentil_operator_node)) : AtString();
+        return lentil_operator_node;
+    }
+
+
+    std::vector<std::string> get_output_strings(AtUniverse *universe) {
+        AtArray* outputs = AiNodeGetArray(AiUniverseGetOptions(universe), AtString("outputs"));
+        std::vector<std::string> output_strings;
+        for (uint32_t i=0; i<AiArrayGetNumElements(outputs); i++) output_strings.push_back(AiArrayGetStr(outputs, i).c_str());
+        return output_strings;
+    }
+
+
+    // the aov plan only depends on the outputs (as rewritten by lentil) and on what the operator collected
+    bool aov_plan_is_current(AtUniverse *universe) {
+        if (aov_plan_outputs.empty()) return false;
+        AtNode *lentil_operator_node = find_lentil_operator(universe);
+        if (!lentil_operator_node) return false;
+        const OperatorData *operator_data = (OperatorData*)AiNodeGetLocalData(lentil_operator_node);
+        return operator_data->aovs.size() == aov_plan_operator_aovs && get_output_strings(universe) == aov_plan_outputs;
+    }
+
+    void store_aov_plan(AtUniverse *universe) {
+        AtNode *lentil_operator_node = find_lentil_operator(universe);
+        aov_plan_operator_aovs = lentil_operator_node ? ((OperatorData*)AiNodeGetLocalData(lentil_operator_node))->aovs.size() : 0;
+        aov_plan_outputs = get_output_strings(universe);
+    }
+
+
+    // the AOV setup is done inside of the operator, which is guaranteed to be
+    // initialized before any other node. Only one lentil_operator is allowed in the scene.
+    // here we just copy some of the data constructed there.
+    void setup_lentil_aovs(AtUniverse *universe) {
+        AtNode *lentil_operator_node = find_lentil_operator(universe);
+
         if (!lentil_operator_node) {
             AiMsgError("[LENTIL] Since Lentil 2.5, lentil requires an operator (lentil_operator) to function. Please insert this operator.");
         }
@@ -1054,12 +2167,10 @@ public:
 
 
     
+    // resolution dependent setup, the aov list is expected to be sanitized already.
+    // buffers are reset in place, so their memory is reused when the resolution doesn't change
     void setup_filter(AtUniverse *universe) {
-        aovcount = aovs.size();
-        sanitize_aov_list(aovs);
-
-        xres_without_region = AiNodeGetInt(options_node, AtString("xres"));
-        yres_without_region = AiNodeGetInt(options_node, AtString("yres"));
+        // xres_without_region and yres_without_region are read in get_arnold_options()
         region_min_x = AiNodeGetInt(options_node, AtString("region_min_x"));
         region_min_y = AiNodeGetInt(options_node, AtString("region_min_y"));
         region_max_x = AiNodeGetInt(options_node, AtString("region_max_x"));
@@ -1078,6 +2189,7 @@ public:
 
         xres = region_max_x - region_min_x + 1;
         yres = region_max_y - region_min_y + 1;
+        frame_aspect_ratio_without_region = (double)xres_without_region/(double)yres_without_region;
         
 
         const AtNodeEntry *oidn_ne = AiNodeEntryLookUp(AtString("imager_denoiser_oidn"));
@@ -1093,9 +2205,24 @@ public:
         current_inv_density = 0.0;
 
 
-        zbuffer.resize(xres * yres);
-        zbuffer_debug.resize(xres * yres);
-        filter_weight_buffer.resize(xres * yres);
+        zbuffer.assign(xres * yres, 0.0f);
+        zbuffer_debug.assign(xres * yres, 0.0f);
+        filter_weight_buffer.assign(xres * yres, 0.0f);
+        splat_convergence.reset(xres, yres);
+        splat_budget.reset(bidir_frame_splat_budget * 1e6, xres * yres);
+        visibility_stats.reset();
+        time_sliced_sources.store(0);
+        redistributed_sources.store(0);
+        redistributed_splats.store(0);
+        redistribution_nanoseconds.store(0);
+        render_session = AiUniverseGetRenderSession(universe);
+
+        const bool gather_blur = bidir_gather_luminance > 0.0;
+        gather_weight_buffer.assign(gather_blur ? xres * yres : 0, 0.0f);
+        gather_coc_buffer.assign(gather_blur ? xres * yres : 0, 0.0f);
+        gather_depth_buffer.assign(gather_blur ? xres * yres : 0, 0.0f);
+        pixel_min_depth_buffer.assign(gather_blur ? xres * yres : 0, AI_INFINITE);
+        gather_pending.store(false);
 
 
         // creates buffers for each AOV with lentil_filter (lentil_replaced_filter)
@@ -1114,6 +2241,8 @@ public:
                     aov.allocate_cryptomatte_buffers(xres, yres);
                 } else {
                     aov.allocate_regular_buffers(xres, yres);
+                    if (gather_blur && aov.original_filter == atstring_filter_gaussian) aov.gather_buffer.assign(xres * yres, AI_RGBA_ZERO);
+                    else aov.gather_buffer.clear();
                 }
 
                 AiMsgInfo("[LENTIL BIDIRECTIONAL] Driver '%s' -- Adding aov %s of type %s", aov.to.driver_tok.c_str(), aov.to.aov_name_tok.c_str(), aov.to.aov_type_tok.c_str());
@@ -1138,6 +2267,17 @@ public:
     }
 
 
+    inline void reset_iterator_to_id(AtAOVSampleIterator* iterator, int id){
+        AiAOVSampleIteratorReset(iterator);
+        
+        for (int i = 0; AiAOVSampleIteratorGetNext(iterator) == true; i++){
+            if (i == id) return;
+        }
+
+        return;
+    }
+
+
 private:
 
     void destroy_buffers() {
@@ -1145,6 +2285,11 @@ private:
         zbuffer_debug.clear();
         aovs.clear();
         filter_weight_buffer.clear();
+        splat_convergence.clear();
+        gather_weight_buffer.clear();
+        gather_coc_buffer.clear();
+        gather_depth_buffer.clear();
+        pixel_min_depth_buffer.clear();
     }
 
 
@@ -1161,31 +2306,14 @@ private:
             return false;
         }
 
-        // if progressive rendering is on, don't redistribute
-        if (enable_dof && bidir_sample_mult != 0 && AiNodeGetBool(AiUniverseGetOptions(universe), AtString("enable_progressive_render"))) {
-            AiMsgError("[LENTIL BIDIRECTIONAL] Progressive rendering is not supported. Arnold does not yet provide enough API functionality for this to be implemented as it should.");
-            AiRenderAbort();
-            return false;
-        }
-
-        // should include an AA sample level test, if not final sample level, skip! currently i have to do ugly counting inside the filter to get the current AA level.
+        // progressive and IPR passes accumulate in the redistribution buffers, weighted by their sample density (see the filter).
+        // passes below 1 AA sample are filtered in place.
 
         return true;
     }
 
 
 
-    inline void reset_iterator_to_id(AtAOVSampleIterator* iterator, int id){
-        AiAOVSampleIteratorReset(iterator);
-        
-        for (int i = 0; AiAOVSampleIteratorGetNext(iterator) == true; i++){
-            if (i == id) return;
-        }
-
-        return;
-    }
-
-
     void get_lentil_camera_params() {
         cameraType = (CameraType) AiNodeGetInt(camera_node, AtString("camera_type"));
 
@@ -1198,6 +2326,13 @@ private:
             else if (meters_per_unit == 0.001) unitModel = static_cast<UnitModel>(0);
         }
 
+        switch (unitModel){
+            case mm: { unit_scale = 10.0; } break;
+            case dm: { unit_scale = 0.1; } break;
+            case m:  { unit_scale = 0.01; } break;
+            default: { unit_scale = 1.0; }
+        }
+
         sensor_width = AiNodeGetFlt(camera_node, AtString("sensor_width"));
         
         enable_dof = AiNodeGetBool(camera_node, AtString("enable_dof"));
@@ -1224,7 +2359,7 @@ private:
         abb_chromatic = AiNodeGetFlt(camera_node, AtString("abb_chromatic"));
         abb_chromatic_type = (ChromaticType) AiNodeGetInt(camera_node, AtString("abb_chromatic_type"));
         circle_to_square = AiNodeGetFlt(camera_node, AtString("bokeh_circle_to_square"));
-        circle_to_square = clamp(circle_to_square, 0.01, 0.99);
+        circle_to_square = clamp(circle_to_square, 0.0, 0.99);
         bokeh_anamorphic = 1.0 - AiNodeGetFlt(camera_node, AtString("bokeh_anamorphic"));
         bokeh_anamorphic = clamp(bokeh_anamorphic, 0, 1.0);
 
@@ -1235,17 +2370,151 @@ private:
         bidir_add_energy_minimum_luminance = AiNodeGetFlt(camera_node, AtString("bidir_add_energy_minimum_luminance"));
         bidir_add_energy = AiNodeGetFlt(camera_node, AtString("bidir_add_energy"));
         bidir_add_energy_transition = AiNodeGetFlt(camera_node, AtString("bidir_add_energy_transition"));
+        bidir_adaptive_threshold = AiNodeGetFlt(camera_node, AtString("bidir_adaptive_threshold"));
+        bidir_frame_splat_budget = AiNodeGetFlt(camera_node, AtString("bidir_frame_splat_budget"));
+        bidir_gather_luminance = AiNodeGetFlt(camera_node, AtString("bidir_gather_luminance"));
+        bidir_cluster_tolerance = AiNodeGetFlt(camera_node, AtString("bidir_cluster_tolerance"));
+        bidir_visibility_cache = AiNodeGetBool(camera_node, AtString("bidir_visibility_cache"));
+        bidir_pixel_time_budget = AiNodeGetFlt(camera_node, AtString("bidir_pixel_time_budget"));
         vignetting_retries = AiNodeGetInt(camera_node, AtString("vignetting_retries"));
         enable_bidir_transmission = AiNodeGetBool(camera_node, AtString("enable_bidir_transmission"));
         enable_skydome = AiNodeGetBool(camera_node, AtString("enable_skydome"));
 
+        if (bokeh_enable_image) aperture_shape = aperture_image;
+        else if (bokeh_aperture_blades < 3) aperture_shape = aperture_disk; // < 3 blades is perfectly circular
+        else aperture_shape = aperture_blades;
+
         
     }
 
 
+    template<bool EnableDof, ApertureShape Shape, OpticalVignettingSampling Vignetting>
+    TraceRayFwKernel select_trace_ray_fw_thinlens_distortion_kernel() {
+        if (abb_distortion > 0.0) return &Camera::trace_ray_fw_thinlens<EnableDof, Shape, true, Vignetting>;
+        return &Camera::trace_ray_fw_thinlens<EnableDof, Shape, false, Vignetting>;
+    }
+
+
+    template<bool EnableDof, ApertureShape Shape>
+    TraceRayFwKernel select_trace_ray_fw_thinlens_kernel() {
+        // only instantiate the sampling strategies that exist for this aperture shape
+        if constexpr (EnableDof && Shape == aperture_disk) {
+            if (optical_vignetting_sampling == vignetting_analytic) return select_trace_ray_fw_thinlens_distortion_kernel<EnableDof, Shape, vignetting_analytic>();
+        }
+        if constexpr (EnableDof && Shape != aperture_image) {
+            if (optical_vignetting_sampling == vignetting_atlas) return select_trace_ray_fw_thinlens_distortion_kernel<EnableDof, Shape, vignetting_atlas>();
+        }
+        if (optical_vignetting_sampling != vignetting_none) return select_trace_ray_fw_thinlens_distortion_kernel<EnableDof, Shape, vignetting_rejection>();
+        return select_trace_ray_fw_thinlens_distortion_kernel<EnableDof, Shape, vignetting_none>();
+    }
+
+
+    template<bool EnableDof, ApertureShape Shape, bool Chromatic>
+    TraceRayFwKernel select_trace_ray_fw_po_pupil_kernel() {
+        switch (outer_pupil_geometry){
+            case pupil_cyl_y: return &Camera::trace_ray_fw_po<EnableDof, Shape, pupil_cyl_y, Chromatic>;
+            case pupil_cyl_x: return &Camera::trace_ray_fw_po<EnableDof, Shape, pupil_cyl_x, Chromatic>;
+            default: return &Camera::trace_ray_fw_po<EnableDof, Shape, pupil_sphere, Chromatic>;
+        }
+    }
+
+
+    template<bool EnableDof, ApertureShape Shape>
+    TraceRayFwKernel select_trace_ray_fw_po_kernel() {
+        // with bidirectional sampling the chromatic aberration is added by the redistribution, tinting the camera rays would apply it twice.
+        // same conditions as get_bidirectional_status(), without redistribution the camera rays are the only place to add it
+        const bool bidirectional = enable_dof && bidir_sample_mult > 0;
+        if (abb_chromatic > 0.0 && !bidirectional) return select_trace_ray_fw_po_pupil_kernel<EnableDof, Shape, true>();
+        return select_trace_ray_fw_po_pupil_kernel<EnableDof, Shape, false>();
+    }
+
+
+    template<bool EnableDof, ApertureShape Shape>
+    TraceRayFwKernel select_trace_ray_fw_model_kernel() {
+        switch (cameraType){
+            case PolynomialOptics: return select_trace_ray_fw_po_kernel<EnableDof, Shape>();
+            default: return select_trace_ray_fw_thinlens_kernel<EnableDof, Shape>();
+        }
+    }
+
+
+    // pick the forward ray kernel matching the current settings, so camera_create_ray doesn't have to
+    void select_trace_ray_fw_kernel() {
+        if (!enable_dof) {
+            trace_ray_fw_kernel = select_trace_ray_fw_model_kernel<false, aperture_disk>(); // aperture shape is irrelevant without dof
+            return;
+        }
+
+        switch (aperture_shape){
+            case aperture_image: { trace_ray_fw_kernel = select_trace_ray_fw_model_kernel<true, aperture_image>(); } break;
+            case aperture_blades: { trace_ray_fw_kernel = select_trace_ray_fw_model_kernel<true, aperture_blades>(); } break;
+            default: { trace_ray_fw_kernel = select_trace_ray_fw_model_kernel<true, aperture_disk>(); }
+        }
+    }
+
+
+    template<ApertureShape Shape, bool Chromatic, ChromaticType ChromaticShift, OpticalVignettingSampling Vignetting>
+    RedistributionKernel select_redistribution_thinlens_distortion_kernel() {
+        if (abb_distortion > 0.0) return &Camera::redistribute_thinlens<Shape, Chromatic, ChromaticShift, true, Vignetting>;
+        return &Camera::redistribute_thinlens<Shape, Chromatic, ChromaticShift, false, Vignetting>;
+    }
+
+
+    template<ApertureShape Shape, bool Chromatic, ChromaticType ChromaticShift>
+    RedistributionKernel select_redistribution_thinlens_abb_kernel() {
+        // the atlas is built for points at the focus distance, so the backward path falls back to rejection for it
+        if constexpr (Shape == aperture_disk) {
+            if (optical_vignetting_sampling == vignetting_analytic) return select_redistribution_thinlens_distortion_kernel<Shape, Chromatic, ChromaticShift, vignetting_analytic>();
+        }
+        if (optical_vignetting_sampling != vignetting_none) return select_redistribution_thinlens_distortion_kernel<Shape, Chromatic, ChromaticShift, vignetting_rejection>();
+        return select_redistribution_thinlens_distortion_kernel<Shape, Chromatic, ChromaticShift, vignetting_none>();
+    }
+
+
+    template<ApertureShape Shape>
+    RedistributionKernel select_redistribution_model_kernel() {
+        const bool chromatic = abb_chromatic > 0.0;
+        switch (cameraType){
+            case PolynomialOptics: return chromatic ? &Camera::redistribute_po<Shape, true> : &Camera::redistribute_po<Shape, false>;
+            default: {
+                if (!chromatic) return select_redistribution_thinlens_abb_kernel<Shape, false, green_magenta>();
+                else if (abb_chromatic_type == red_cyan) return select_redistribution_thinlens_abb_kernel<Shape, true, red_cyan>();
+                return select_redistribution_thinlens_abb_kernel<Shape, true, green_magenta>();
+            }
+        }
+    }
+
+
+    // pick the backward redistribution kernel matching the current settings, so filter_pixel doesn't have to
+    void select_redistribution_kernel() {
+        switch (aperture_shape){
+            case aperture_image: { redistribution_kernel = select_redistribution_model_kernel<aperture_image>(); } break;
+            case aperture_blades: { redistribution_kernel = select_redistribution_model_kernel<aperture_blades>(); } break;
+            default: { redistribution_kernel = select_redistribution_model_kernel<aperture_disk>(); }
+        }
+        redistribution_kernel_name = describe_redistribution_kernel();
+    }
+
+    // the configuration the selected kernel is specialised for, mirrors the selection above
+    std::string describe_redistribution_kernel() const {
+        std::string name = cameraType == PolynomialOptics ? "polynomial optics" : "thin lens";
+        name += aperture_shape == aperture_image ? ", bokeh image" : (aperture_shape == aperture_blades ? ", blades" : ", disk");
+        if (abb_chromatic > 0.0) {
+            if (cameraType == PolynomialOptics) name += ", chromatic";
+            else name += abb_chromatic_type == red_cyan ? ", chromatic red/cyan" : ", chromatic green/magenta";
+        }
+        if (cameraType != PolynomialOptics) {
+            if (abb_distortion > 0.0) name += ", distortion";
+            if (optical_vignetting_sampling == vignetting_analytic && aperture_shape == aperture_disk) name += ", analytic vignetting";
+            else if (optical_vignetting_sampling != vignetting_none) name += ", rejection vignetting";
+        }
+        return name;
+    }
+
+
     void get_arnold_options() {
-        xres = AiNodeGetInt(options_node, AtString("xres"));
-        yres = AiNodeGetInt(options_node, AtString("yres"));
+        xres = xres_without_region = AiNodeGetInt(options_node, AtString("xres"));
+        yres = yres_without_region = AiNodeGetInt(options_node, AtString("yres"));
     }
 
 
@@ -1265,6 +2534,46 @@ private:
         return std::max(0.0, out_transmittance);
     }
 
+    // jacobian of the polynomial mapping sensor to outer pupil, J(i,j) = d out_i / d in_j
+    inline void lens_evaluate_jacobian(const Eigen::VectorXd &in, Eigen::Matrix<double, 5, 5> &J)
+    {
+        const double x = in[0], y = in[1], dx = in[2], dy = in[3], lambda = in[4];
+        double dx00 = 0.0, dx01 = 0.0, dx02 = 0.0, dx03 = 0.0, dx04 = 0.0;
+        double dx10 = 0.0, dx11 = 0.0, dx12 = 0.0, dx13 = 0.0, dx14 = 0.0;
+        double dx20 = 0.0, dx21 = 0.0, dx22 = 0.0, dx23 = 0.0, dx24 = 0.0;
+        double dx30 = 0.0, dx31 = 0.0, dx32 = 0.0, dx33 = 0.0, dx34 = 0.0;
+        double dx40 = 0.0, dx41 = 0.0, dx42 = 0.0, dx43 = 0.0, dx44 = 0.0;
+        switch (lensModel){
+            #include "../include/auto_generated_lens_includes/load_pt_evaluate_jacobian.h"
+        }
+
+        J(0,0) = dx00; J(0,1) = dx01; J(0,2) = dx02; J(0,3) = dx03; J(0,4) = dx04;
+        J(1,0) = dx10; J(1,1) = dx11; J(1,2) = dx12; J(1,3) = dx13; J(1,4) = dx14;
+        J(2,0) = dx20; J(2,1) = dx21; J(2,2) = dx22; J(2,3) = dx23; J(2,4) = dx24;
+        J(3,0) = dx30; J(3,1) = dx31; J(3,2) = dx32; J(3,3) = dx33; J(3,4) = dx34;
+        J(4,0) = dx40; J(4,1) = dx41; J(4,2) = dx42; J(4,3) = dx43; J(4,4) = dx44;
+    }
+
+    // jacobian of the polynomial mapping sensor to aperture
+    inline void lens_evaluate_aperture_jacobian(const Eigen::VectorXd &in, Eigen::Matrix<double, 5, 5> &J)
+    {
+        const double x = in[0], y = in[1], dx = in[2], dy = in[3], lambda = in[4];
+        double dx00 = 0.0, dx01 = 0.0, dx02 = 0.0, dx03 = 0.0, dx04 = 0.0;
+        double dx10 = 0.0, dx11 = 0.0, dx12 = 0.0, dx13 = 0.0, dx14 = 0.0;
+        double dx20 = 0.0, dx21 = 0.0, dx22 = 0.0, dx23 = 0.0, dx24 = 0.0;
+        double dx30 = 0.0, dx31 = 0.0, dx32 = 0.0, dx33 = 0.0, dx34 = 0.0;
+        double dx40 = 0.0, dx41 = 0.0, dx42 = 0.0, dx43 = 0.0, dx44 = 0.0;
+        switch (lensModel){
+            #include "../include/auto_generated_lens_includes/load_pt_evaluate_aperture_jacobian.h"
+        }
+
+        J(0,0) = dx00; J(0,1) = dx01; J(0,2) = dx02; J(0,3) = dx03; J(0,4) = dx04;
+        J(1,0) = dx10; J(1,1) = dx11; J(1,2) = dx12; J(1,3) = dx13; J(1,4) = dx14;
+        J(2,0) = dx20; J(2,1) = dx21; J(2,2) = dx22; J(2,3) = dx23; J(2,4) = dx24;
+        J(3,0) = dx30; J(3,1) = dx31; J(3,2) = dx32; J(3,3) = dx33; J(3,4) = dx34;
+        J(4,0) = dx40; J(4,1) = dx41; J(4,2) = dx42; J(4,3) = dx43; J(4,4) = dx44;
+    }
+
     // solves for the two directions [dx,dy], keeps the two positions [x,y] and the
     // wavelength, such that the path through the lens system will be valid, i.e.
     // lens_evaluate_aperture(in, out) will yield the same out given the solved for in.
@@ -1348,9 +2657,7 @@ private:
         Eigen::Vector2d outdir(out(2), out(3));
         Eigen::Vector3d camera_space_pos(0,0,0);
         Eigen::Vector3d camera_space_omega(0,0,0);
-        if (lens_outer_pupil_geometry == "cyl-y") cylinderToCs(outpos, outdir, camera_space_pos, camera_space_omega, -lens_outer_pupil_curvature_radius, lens_outer_pupil_curvature_radius, true);
-            else if (lens_outer_pupil_geometry == "cyl-x") cylinderToCs(outpos, outdir, camera_space_pos, camera_space_omega, -lens_outer_pupil_curvature_radius, lens_outer_pupil_curvature_radius, false);
-        else sphereToCs(outpos, outdir, camera_space_pos, camera_space_omega, -lens_outer_pupil_curvature_radius, lens_outer_pupil_curvature_radius);
+        outer_pupil_to_camera_space(outpos, outdir, camera_space_pos, camera_space_omega);
 
         test_focus_distance = line_plane_intersection(camera_space_pos, camera_space_omega)(2);
         return true;
@@ -1378,61 +2685,81 @@ private:
         Eigen::Vector2d outdir(out(2), out(3));
             Eigen::Vector3d camera_space_pos(0,0,0);
             Eigen::Vector3d camera_space_omega(0,0,0);
-        if (lens_outer_pupil_geometry == "cyl-y") cylinderToCs(outpos, outdir, camera_space_pos, camera_space_omega, -lens_outer_pupil_curvature_radius, lens_outer_pupil_curvature_radius, true);
-            else if (lens_outer_pupil_geometry == "cyl-x") cylinderToCs(outpos, outdir, camera_space_pos, camera_space_omega, -lens_outer_pupil_curvature_radius, lens_outer_pupil_curvature_radius, false);
-        else sphereToCs(outpos, outdir, camera_space_pos, camera_space_omega, -lens_outer_pupil_curvature_radius, lens_outer_pupil_curvature_radius);
+        outer_pupil_to_camera_space(outpos, outdir, camera_space_pos, camera_space_omega);
         
         return line_plane_intersection(camera_space_pos, camera_space_omega)(2);
     }
 
 
     // note that this is all with an unshifted sensor
+    // traces a ray parallel to the optical axis at parallel_ray_height backwards through the lens.
+    // returns false when it doesn't make it to the sensor.
+    inline bool fstop_at_parallel_ray_height(const double parallel_ray_height, double &fstop) {
+        const Eigen::Vector3d target(0, parallel_ray_height, AI_BIG);
+        Eigen::VectorXd sensor(5); sensor << 0,0,0,0, lambda;
+        Eigen::VectorXd out(5); out.setZero();
+
+        // just point through center of aperture
+        Eigen::Vector2d aperture(0.01, parallel_ray_height);
+
+        if(lens_lt_sample_aperture(target, aperture, sensor, out, lambda) <= 0.0) return false;
+
+        // crop at inner pupil
+        const double px = sensor(0) + (sensor(2) * lens_back_focal_length);
+        const double py = sensor(1) + (sensor(3) * lens_back_focal_length);
+        if (px*px + py*py > lens_inner_pupil_radius*lens_inner_pupil_radius) return false;
+
+        // somehow need to get last vertex positiondata.. don't think what i currently have is correct
+        Eigen::Vector3d out_cs_pos(0,0,0);
+        Eigen::Vector3d out_cs_dir(0,0,0);
+        Eigen::Vector2d outpos(out(0), out(1));
+        Eigen::Vector2d outdir(out(2), out(3)); 
+        switch (inner_pupil_geometry){
+            case pupil_cyl_y: { cylinderToCs(outpos, outdir, out_cs_pos, out_cs_dir, - lens_inner_pupil_curvature_radius + lens_back_focal_length, lens_inner_pupil_curvature_radius, true); } break;
+            case pupil_cyl_x: { cylinderToCs(outpos, outdir, out_cs_pos, out_cs_dir, - lens_inner_pupil_curvature_radius + lens_back_focal_length, lens_inner_pupil_curvature_radius, false); } break;
+            default: { sphereToCs(outpos, outdir, out_cs_pos, out_cs_dir, - lens_inner_pupil_curvature_radius + lens_back_focal_length, lens_inner_pupil_curvature_radius); }
+        }
+
+        const double theta = std::atan(out_cs_pos(1) / out_cs_pos(2));
+        fstop = 1.0 / (std::sin(theta)* 2.0);
+        return fstop == fstop;
+    }
+
+
+    // finds the largest parallel ray height that still reaches the sensor with an f-stop of at least fstop_target.
+    // the f-stop decreases with the ray height, so a coarse scan brackets the answer and bisection refines it.
     inline void trace_backwards_for_fstop(const double fstop_target, double &calculated_fstop, double &calculated_aperture_radius) {
-        const int maxrays = 1000;
+        const int coarse_steps = 32;
+        const int bisection_steps = 40;
+        const double step = lens_outer_pupil_radius / static_cast<double>(coarse_steps);
         double best_valid_fstop = 0.0;
         double best_valid_aperture_radius = 0.0;
 
-        for (int i = 1; i < maxrays; i++)
-        {
-            const double parallel_ray_height = (static_cast<double>(i)/static_cast<double>(maxrays)) * lens_outer_pupil_radius;
-            const Eigen::Vector3d target(0, parallel_ray_height, AI_BIG);
-            Eigen::VectorXd sensor(5); sensor << 0,0,0,0, lambda;
-            Eigen::VectorXd out(5); out.setZero();
-
-            // just point through center of aperture
-            Eigen::Vector2d aperture(0.01, parallel_ray_height);
-
-            // if (!lens_lt_sample_aperture(target, aperture, sensor, out, lambda, camera)) continue;
-            if(lens_lt_sample_aperture(target, aperture, sensor, out, lambda) <= 0.0) continue;
-
-            // crop at inner pupil
-            const double px = sensor(0) + (sensor(2) * lens_back_focal_length);
-            const double py = sensor(1) + (sensor(3) * lens_back_focal_length);
-            if (px*px + py*py > lens_inner_pupil_radius*lens_inner_pupil_radius) continue;
-
-            // somehow need to get last vertex positiondata.. don't think what i currently have is correct
-            Eigen::Vector3d out_cs_pos(0,0,0);
-            Eigen::Vector3d out_cs_dir(0,0,0);
-            Eigen::Vector2d outpos(out(0), out(1));
-            Eigen::Vector2d outdir(out(2), out(3)); 
-            if (lens_inner_pupil_geometry == "cyl-y") {
-                cylinderToCs(outpos, outdir, out_cs_pos, out_cs_dir, - lens_inner_pupil_curvature_radius + lens_back_focal_length, lens_inner_pupil_curvature_radius, true);
-            }
-            else if (lens_inner_pupil_geometry == "cyl-x") {
-                cylinderToCs(outpos, outdir, out_cs_pos, out_cs_dir, - lens_inner_pupil_curvature_radius + lens_back_focal_length, lens_inner_pupil_curvature_radius, false);
-            }
-            else sphereToCs(outpos, outdir, out_cs_pos, out_cs_dir, - lens_inner_pupil_curvature_radius + lens_back_focal_length, lens_inner_pupil_curvature_radius);
-
-            const double theta = std::atan(out_cs_pos(1) / out_cs_pos(2));
-            const double fstop = 1.0 / (std::sin(theta)* 2.0);
+        // invalid heights are skipped, the scan stops at the first height that opens up too far
+        for (int i = 1; i <= coarse_steps; i++) {
+            const double parallel_ray_height = static_cast<double>(i) * step;
+            double fstop = 0.0;
+            if (!fstop_at_parallel_ray_height(parallel_ray_height, fstop)) continue;
+            if (fstop < fstop_target) break;
+            best_valid_fstop = fstop;
+            best_valid_aperture_radius = parallel_ray_height;
+        }
 
-            if (fstop < fstop_target) {
-                calculated_fstop = best_valid_fstop;
-                calculated_aperture_radius = best_valid_aperture_radius;
-                return;
-            } else {
-                best_valid_fstop = fstop;
-                best_valid_aperture_radius = parallel_ray_height;
+        // bisect between the last accepted height and the next coarse step,
+        // which either opens up too far or no longer transmits
+        if (best_valid_aperture_radius > 0.0) {
+            double lo = best_valid_aperture_radius;
+            double hi = std::min(lo + step, lens_outer_pupil_radius);
+            for (int i = 0; i < bisection_steps && hi - lo > 1e-9; i++) {
+                const double mid = 0.5 * (lo + hi);
+                double fstop = 0.0;
+                if (fstop_at_parallel_ray_height(mid, fstop) && fstop >= fstop_target) {
+                    lo = mid;
+                    best_valid_fstop = fstop;
+                    best_valid_aperture_radius = mid;
+                } else {
+                    hi = mid;
+                }
             }
         }
 
@@ -1442,7 +2769,8 @@ private:
 
 
     // focal_distance is in mm
-    inline double logarithmic_focus_search(const double focal_distance){
+    // brute force search over the full logarithmic table, only used when the bracketed solve below fails
+    inline double logarithmic_focus_search_exhaustive(const double focal_distance){
         double closest_distance = 999999999.0;
         double best_sensor_shift = 0.0;
         for (double sensorshift : logarithmic_values()){
@@ -1460,6 +2788,143 @@ private:
     }
 
 
+    // focal_distance is in mm
+    // brackets the sensor shift on a coarse subset of the logarithmic table and refines it with the illinois variant of regula falsi.
+    // the root is found on the vergence (1/distance) rather than on the distance itself, which is smooth
+    // where the exiting ray turns parallel and makes focusing at infinity an ordinary root.
+    inline double logarithmic_focus_search(const double focal_distance){
+        const std::vector<double> &shifts = logarithmic_values();
+        const size_t stride = 80;
+        const double target_vergence = 1.0 / focal_distance;
+
+        auto vergence_error = [&](const double shift) {
+            return 1.0 / camera_get_y0_intersection_distance(shift, 0.0) - target_vergence;
+        };
+
+        bool found = false;
+        double best_sensor_shift = 0.0;
+
+        double a = shifts[0];
+        double fa = vergence_error(a);
+        for (size_t i = stride; i < shifts.size() + stride - 1; i += stride) {
+            const double b = shifts[std::min(i, shifts.size() - 1)];
+            const double fb = vergence_error(b);
+
+            if (fa == fa && fb == fb && (fa == 0.0 || fa * fb < 0.0)) {
+                // illinois refinement of the bracket [a, b]
+                double lo = a, flo = fa, hi = b, fhi = fb;
+                double root = fa == 0.0 ? a : b;
+                for (int iter = 0; iter < 64 && fa != 0.0; iter++) {
+                    double c = hi - fhi * (hi - lo) / (fhi - flo);
+                    if (!(c > std::min(lo, hi) && c < std::max(lo, hi))) c = 0.5 * (lo + hi);
+                    const double fc = vergence_error(c);
+                    root = c;
+                    if (fc == 0.0 || std::abs(hi - lo) < 1e-10 || fc != fc) break;
+                    if (fc * fhi < 0.0) {
+                        lo = hi; flo = fhi;
+                    } else {
+                        flo *= 0.5;
+                    }
+                    hi = c; fhi = fc;
+                }
+
+                // a sign change can also come from the intersection flipping behind the lens, only keep real focus points.
+                // when the lens has several, prefer the one closest to the nominal sensor position
+                const double intersection_distance = camera_get_y0_intersection_distance(root, 0.0);
+                if (intersection_distance > 0.0 && (!found || std::abs(root) < std::abs(best_sensor_shift))) {
+                    best_sensor_shift = root;
+                    found = true;
+                }
+            }
+
+            a = b;
+            fa = fb;
+        }
+
+        if (!found) {
+            AiMsgWarning("[LENTIL CAMERA PO] could not bracket the focus distance, falling back to exhaustive search");
+            return logarithmic_focus_search_exhaustive(focal_distance);
+        }
+
+        return best_sensor_shift;
+    }
+
+
+    // traces the chief ray from the edge of the sensor through the center of the aperture,
+    // returns the full field of view in radians at this sensor shift
+    inline double field_of_view_at_sensor_shift(const double shift)
+    {
+        Eigen::VectorXd sensor(5); sensor << sensor_width * 0.5, 0.0, 0.0, 0.0, lambda;
+        Eigen::VectorXd aperture(5); aperture.setZero();
+        Eigen::VectorXd out(5); out.setZero();
+
+        lens_pt_sample_aperture(sensor, aperture, shift);
+        sensor(0) += sensor(2) * shift;
+        sensor(1) += sensor(3) * shift;
+        if (lens_evaluate(sensor, out) <= 0.0) return lens_field_of_view;
+
+        Eigen::Vector2d outpos(out(0), out(1));
+        Eigen::Vector2d outdir(out(2), out(3));
+        Eigen::Vector3d camera_space_pos(0,0,0);
+        Eigen::Vector3d camera_space_omega(0,0,0);
+        outer_pupil_to_camera_space(outpos, outdir, camera_space_pos, camera_space_omega);
+
+        const double fov = 2.0 * std::atan2(std::sqrt(camera_space_omega(0)*camera_space_omega(0) + camera_space_omega(1)*camera_space_omega(1)), std::abs(camera_space_omega(2)));
+        return fov == fov ? fov : lens_field_of_view;
+    }
+
+
+    // reads the focus breathing curve of the current lens from the cache, or builds it.
+    // the near end of the curve sits at ten times the focal length, roughly the close focus of most lenses
+    inline void setup_focus_breathing_curve()
+    {
+        // the field of view and effective focal length of the curve are measured on the sensor, so they depend on its width
+        const std::string key = LensSolveCache::make_key("breathing", lens_name, {static_cast<double>(lensModel), lambda, sensor_width, static_cast<double>(FocusBreathingCurve::nodes)});
+        std::vector<double> cached;
+        if (LensSolveCache::lookup(key, cached) && focus_breathing.deserialize(cached)) return;
+
+        const auto time_start = std::chrono::high_resolution_clock::now();
+        focus_breathing.clear();
+        focus_breathing.near_distance = 10.0 * lens_effective_focal_length;
+        for (int i = 0; i < FocusBreathingCurve::nodes; i++) {
+            const double shift = logarithmic_focus_search(focus_breathing.distance(i));
+            const double fov = field_of_view_at_sensor_shift(shift);
+            focus_breathing.sensor_shift.push_back(shift);
+            focus_breathing.field_of_view.push_back(fov);
+            focus_breathing.effective_focal_length.push_back(sensor_width * 0.5 / std::tan(fov * 0.5));
+        }
+        LensSolveCache::store(key, focus_breathing.serialize());
+
+        const double build_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - time_start).count();
+        AiMsgInfo("[LENTIL CAMERA PO] built focus breathing curve in %.1f ms", build_time);
+    }
+
+
+    // lens solves through the persistent cache, see lens_cache.h
+    inline double cached_focus_search(const double focal_distance){
+        const std::string key = LensSolveCache::make_key("focus", lens_name, {static_cast<double>(lensModel), lambda, focal_distance});
+        std::vector<double> cached;
+        if (LensSolveCache::lookup(key, cached) && cached.size() == 1) return cached[0];
+
+        const double sensor_shift = logarithmic_focus_search(focal_distance);
+        LensSolveCache::store(key, {sensor_shift});
+        return sensor_shift;
+    }
+
+    inline void cached_fstop_search(const double fstop_target, double &calculated_fstop, double &calculated_aperture_radius) {
+        const std::string key = LensSolveCache::make_key("fstop", lens_name, {static_cast<double>(lensModel), lambda, fstop_target});
+        std::vector<double> cached;
+        if (LensSolveCache::lookup(key, cached) && cached.size() == 2) {
+            calculated_fstop = cached[0];
+            calculated_aperture_radius = cached[1];
+            return;
+        }
+
+        trace_backwards_for_fstop(fstop_target, calculated_fstop, calculated_aperture_radius);
+        LensSolveCache::store(key, {calculated_fstop, calculated_aperture_radius});
+    }
+
+
 
     // returns sensor offset in mm
     // traces rays backwards through the lens
@@ -1565,16 +3030,81 @@ private:
 
     
 
+    // (re)builds the valid aperture atlas, only when one of the settings it depends on changed.
+    // polynomial optics: lens transmission, thin lens: optical vignetting.
+    void setup_aperture_atlas() {
+        const double extent_y = static_cast<double>(yres_without_region) / static_cast<double>(xres_without_region);
+        std::vector<double> settings = {static_cast<double>(cameraType), static_cast<double>(aperture_shape), static_cast<double>(bokeh_aperture_blades),
+                                        extent_y, sensor_width, aperture_radius};
+        if (cameraType == PolynomialOptics) {
+            settings.insert(settings.end(), {static_cast<double>(lensModel), sensor_shift, lambda});
+        } else {
+            settings.insert(settings.end(), {focal_length, focus_distance, optical_vignetting_distance, optical_vignetting_radius,
+                                             circle_to_square, abb_spherical, bokeh_anamorphic, abb_distortion, abb_coma});
+        }
+        if (aperture_atlas.is_built_for(settings)) return;
+
+        const auto time_start = std::chrono::high_resolution_clock::now();
+
+        if (cameraType == PolynomialOptics) {
+            aperture_atlas.build(settings, 1.0, extent_y, [this](const double sx, const double sy, const double r1, const double r2){
+                Eigen::Vector2d unit_disk(0.0, 0.0);
+                aperture_sampler.sample(aperture_shape, r1, r2, unit_disk);
+
+                Eigen::VectorXd sensor(5); sensor << sx * (sensor_width * 0.5), sy * (sensor_width * 0.5), 0.0, 0.0, lambda;
+                Eigen::VectorXd aperture(5); aperture << unit_disk(0) * aperture_radius, unit_disk(1) * aperture_radius, 0.0, 0.0, 0.0;
+                Eigen::VectorXd out(5); out.setZero();
+                return po_ray_transmits<true>(sensor, aperture, out);
+            });
+        } else {
+            // same construction as trace_ray_fw_thinlens, up to the optical vignetting test
+            aperture_atlas.build(settings, 1.0, extent_y, [this](const double sx, const double sy, const double r1, const double r2){
+                AtVector2 s(sx, sy);
+                if (abb_distortion > 0.0) s = barrelDistortion(s, abb_distortion);
+                const AtVector dir_from_center = AiV3Normalize(AtVector(s.x * (sensor_width*0.5), s.y * (sensor_width*0.5), -focal_length));
+                const AtVector focusPoint = dir_from_center * std::abs(focus_distance / dir_from_center.z);
+
+                Eigen::Vector2d unit_disk(0.0, 0.0);
+                aperture_sampler.sample(aperture_shape, r1, r2, unit_disk);
+                unit_disk(0) *= bokeh_anamorphic;
+
+                const AtVector lens(unit_disk(0) * aperture_radius, unit_disk(1) * aperture_radius, 0.0);
+                AtVector dir_from_lens = AiV3Normalize(focusPoint - lens);
+                const float abb_coma_multiplied = abb_coma * abb_coma_multipliers(sensor_width, focal_length, dir_from_center, unit_disk);
+                dir_from_lens = abb_coma_perturb(dir_from_lens, dir_from_lens, abb_coma_multiplied, false);
+
+                return empericalOpticalVignettingSquare(lens, dir_from_lens, aperture_radius, optical_vignetting_radius, optical_vignetting_distance, lerp_squircle_mapping(circle_to_square));
+            });
+        }
+
+        const double build_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - time_start).count();
+        AiMsgInfo("[LENTIL CAMERA] built aperture atlas in %.1f ms", build_time);
+    }
+
+
     void camera_model_specific_setup () {
 
+        // the thin lens warps its disc with the spherical aberration and square blend, polynomial optics samples it uniformly
+        if (cameraType == ThinLens) aperture_sampler.setup(bokeh_aperture_blades, abb_spherical, circle_to_square);
+        else aperture_sampler.setup(bokeh_aperture_blades, 0.5, 0.0);
+
         switch (cameraType){
             case PolynomialOptics:
             {
                 focus_distance *= 10.0;
+
+                // the lens solve and atlas only depend on these, everything they produce is kept on the camera
+                const std::vector<double> settings{static_cast<double>(lensModel), lambda, focus_distance, input_fstop, extra_sensor_shift,
+                                                   sensor_width, static_cast<double>(enable_dof), static_cast<double>(aperture_shape),
+                                                   static_cast<double>(bokeh_aperture_blades), static_cast<double>(xres_without_region), static_cast<double>(yres_without_region)};
+                if (settings == lens_setup_settings) break;
+                lens_setup_settings.clear();
                 
                 switch (lensModel){
                     #include "../include/auto_generated_lens_includes/load_lens_constants.h"
                 }
+                inner_pupil_geometry = pupil_geometry_from_string(lens_inner_pupil_geometry);
+                outer_pupil_geometry = pupil_geometry_from_string(lens_outer_pupil_geometry);
 
                 AiMsgInfo("[LENTIL CAMERA PO] ----------  LENS CONSTANTS  -----------");
                 AiMsgInfo("[LENTIL CAMERA PO] Lens Name: %s", lens_name);
@@ -1601,51 +3131,45 @@ private:
                 AiMsgInfo("[LENTIL CAMERA PO] wavelength: %f nm", lambda);
 
 
-                if (input_fstop == 0.0) {
-                    aperture_radius = lens_aperture_radius_at_fstop;
-                } else {
-                    double calculated_fstop = 0.0;
-                    double calculated_aperture_radius = 0.0;
-                    trace_backwards_for_fstop(input_fstop, calculated_fstop, calculated_aperture_radius);
-                    
-                    AiMsgInfo("[LENTIL CAMERA PO] calculated fstop: %f", calculated_fstop);
-                    AiMsgInfo("[LENTIL CAMERA PO] calculated aperture radius: %f mm", calculated_aperture_radius);
-                    
-                    aperture_radius = std::min(lens_aperture_radius_at_fstop, calculated_aperture_radius);
+                // the f-stop and focus solves are independent, the f-stop one runs alongside the focus solve
+                double calculated_fstop = 0.0;
+                double calculated_aperture_radius = 0.0;
+                std::future<void> fstop_task;
+                if (input_fstop != 0.0) {
+                    fstop_task = std::async(std::launch::async, [this, &calculated_fstop, &calculated_aperture_radius]{
+                        cached_fstop_search(input_fstop, calculated_fstop, calculated_aperture_radius);
+                    });
                 }
 
-                AiMsgInfo("[LENTIL CAMERA PO] lens wide open f-stop: %f", lens_fstop);
-                AiMsgInfo("[LENTIL CAMERA PO] lens wide open aperture radius: %f mm", lens_aperture_radius_at_fstop);
-                AiMsgInfo("[LENTIL CAMERA PO] fstop-calculated aperture radius: %f mm", aperture_radius);
-                AiMsgInfo("[LENTIL CAMERA PO] --------------------------------------");
-
 
                 AiMsgInfo("[LENTIL CAMERA PO] user supplied focus distance: %f mm", focus_distance);
 
-                /*
-                AiMsgInfo("[LENTIL CAMERA PO] calculating sensor shift at focus distance:");
-                sensor_shift = camera_set_focus(focus_distance, po);
-                AiMsgInfo("[LENTIL CAMERA PO] sensor_shift to focus at %f: %f", focus_distance, sensor_shift);
-                */
-
-                // logartihmic focus search
-                double best_sensor_shift = logarithmic_focus_search(focus_distance);
-                AiMsgInfo("[LENTIL CAMERA PO] sensor_shift using logarithmic search: %f mm", best_sensor_shift);
+                // focus pulls read the precomputed breathing curve, so every frame gets a consistent focus without a solve
+                setup_focus_breathing_curve();
+                double best_sensor_shift = 0.0;
+                double effective_focal_length = lens_effective_focal_length;
+                double field_of_view = lens_field_of_view;
+                if (focus_breathing.covers(focus_distance)) {
+                    focus_breathing.lookup(focus_distance, best_sensor_shift, effective_focal_length, field_of_view);
+                    AiMsgInfo("[LENTIL CAMERA PO] sensor_shift from focus breathing curve: %f mm", best_sensor_shift);
+                } else {
+                    best_sensor_shift = cached_focus_search(focus_distance);
+                    field_of_view = field_of_view_at_sensor_shift(best_sensor_shift);
+                    effective_focal_length = sensor_width * 0.5 / std::tan(field_of_view * 0.5);
+                    AiMsgInfo("[LENTIL CAMERA PO] sensor_shift using logarithmic search: %f mm", best_sensor_shift);
+                }
                 sensor_shift = best_sensor_shift + extra_sensor_shift;
+                AiMsgInfo("[LENTIL CAMERA PO] effective focal length at focus distance: %f mm", effective_focal_length);
 
-                /*
-                // average guesses infinity focus search
-                double infinity_focus_sensor_shift = camera_set_focus(AI_BIG, po);
-                AiMsgInfo("[LENTIL CAMERA PO] sensor_shift [average guesses backwards light tracing] to focus at infinity: %f", infinity_focus_sensor_shift);
-                */
-
+                #ifdef DEBUG_LOG
                 // logarithmic infinity focus search
-                double best_sensor_shift_infinity = logarithmic_focus_search(999999999.0);
+                double best_sensor_shift_infinity = cached_focus_search(999999999.0);
                 AiMsgInfo("[LENTIL CAMERA PO] sensor_shift [logarithmic forward tracing] to focus at infinity: %f mm", best_sensor_shift_infinity);
                     
                 // bidirectional parallel infinity focus search
                 double infinity_focus_parallel_light_tracing = camera_set_focus_infinity();
                 AiMsgInfo("[LENTIL CAMERA PO] sensor_shift [parallel backwards light tracing] to focus at infinity: %f mm", infinity_focus_parallel_light_tracing);
+                #endif
 
                 // double check where y=0 intersection point is, should be the same as focus distance
                 double test_focus_distance = 0.0;
@@ -1655,17 +3179,54 @@ private:
                     AiMsgWarning("[LENTIL CAMERA PO] focus check failed. Either the lens system is not correct, or the sensor is placed at a wrong distance.");
                 }
 
-                tan_fov = std::tan(lens_field_of_view / 2.0);
+                tan_fov = std::tan(field_of_view / 2.0);
+
+
+                if (input_fstop == 0.0) {
+                    aperture_radius = lens_aperture_radius_at_fstop;
+                } else {
+                    fstop_task.get();
+                    AiMsgInfo("[LENTIL CAMERA PO] calculated fstop: %f", calculated_fstop);
+                    AiMsgInfo("[LENTIL CAMERA PO] calculated aperture radius: %f mm", calculated_aperture_radius);
+                    
+                    aperture_radius = std::min(lens_aperture_radius_at_fstop, calculated_aperture_radius);
+                }
+
+                AiMsgInfo("[LENTIL CAMERA PO] lens wide open f-stop: %f", lens_fstop);
+                AiMsgInfo("[LENTIL CAMERA PO] lens wide open aperture radius: %f mm", lens_aperture_radius_at_fstop);
+                AiMsgInfo("[LENTIL CAMERA PO] fstop-calculated aperture radius: %f mm", aperture_radius);
+
+                if (enable_dof && aperture_shape != aperture_image) setup_aperture_atlas();
+                lens_setup_settings = settings;
 
                 AiMsgInfo("[LENTIL CAMERA PO] --------------------------------------");
 
             } break;
             case ThinLens:
             {
+                lens_setup_settings.clear();
                 fov = 2.0 * std::atan(sensor_width / (2.0*focal_length));
                 tan_fov = std::tan(fov/2.0);
                 aperture_radius = (focal_length / (2.0 * input_fstop)) / 10.0;
+
+                // a uniform circular aperture without coma leaves the intersection of two disks, which can be sampled directly
+                const bool circular_aperture = aperture_shape == aperture_disk && abb_spherical == 0.5 && circle_to_square == 0.0 && bokeh_anamorphic == 1.0;
+                if (optical_vignetting_distance <= 0.0) optical_vignetting_sampling = vignetting_none;
+                else if (circular_aperture && abb_coma == 0.0) optical_vignetting_sampling = vignetting_analytic;
+                else if (enable_dof && aperture_shape != aperture_image) optical_vignetting_sampling = vignetting_atlas;
+                else optical_vignetting_sampling = vignetting_rejection;
+
+                if (optical_vignetting_sampling == vignetting_atlas) setup_aperture_atlas();
             } break;
         }
     }
-};
\ No newline at end of file
+};
+
+
+// lentil nodes other than the camera use this to finish the deferred aov setup, see Camera::complete_aov_setup()
+inline void lentil_complete_aov_setup(AtUniverse *universe) {
+    AtNode *camera_node = AiUniverseGetCamera(universe);
+    if (!camera_node || AiNodeEntryGetNameAtString(AiNodeGetNodeEntry(camera_node)) != AtString("lentil_camera")) return;
+    Camera *camera_data = (Camera*)AiNodeGetLocalData(camera_node);
+    if (camera_data) camera_data->complete_aov_setup(universe);
+}
@@ -45,6 +45,12 @@ node_parameters {
   AiParameterFlt("bidir_add_energy", 0.0);
   AiParameterFlt("bidir_add_energy_minimum_luminance", 2.0);
   AiParameterFlt("bidir_add_energy_transition", 1.0);
+  AiParameterFlt("bidir_adaptive_threshold", 0.0);
+  AiParameterFlt("bidir_frame_splat_budget", 0.0);
+  AiParameterFlt("bidir_gather_luminance", 0.0);
+  AiParameterFlt("bidir_cluster_tolerance", 0.0);
+  AiParameterBool("bidir_visibility_cache", false);
+  AiParameterFlt("bidir_pixel_time_budget", 0.0);
   AiParameterBool("enable_bidir_transmission", false)
   AiParameterBool("enable_skydome", false)
 
@@ -81,43 +87,18 @@ camera_create_ray {
   int tries = 0;
   double r1 = input.lensx;
   double r2 = input.lensy; 
-  const float step = 0.001;
 
   AtVector origin(0,0,0);
   AtVector direction(0,0,0);
   AtRGB weight(1,1,1);
+  RayDerivatives derivs;
 
-  if (camera_data->cameraType == ThinLens){
-    camera_data->trace_ray_fw_thinlens(tries, input.sx, input.sy, origin, direction, weight, r1, r2, false);
-  } else if (camera_data->cameraType == PolynomialOptics){
-    camera_data->trace_ray_fw_po(tries, input.sx, input.sy, origin, direction, weight, r1, r2, false);
-  }
-
-  // if (tries > 0){
-    float input_dx_sx = input.sx + (input.dsx * step);
-    float input_dx_sy = input.sy + (input.dsy * step);
-
-    AtVector output_dx_origin(0,0,0);
-    AtVector output_dy_origin(0,0,0);
-    AtVector output_dx_dir(0,0,0);
-    AtVector output_dy_dir(0,0,0);
-    AtRGB output_dx_weight = AI_RGB_WHITE;
-    AtRGB output_dy_weight = AI_RGB_WHITE;
-    
-    if (camera_data->cameraType == ThinLens){
-        camera_data->trace_ray_fw_thinlens(tries, input_dx_sx, input.sy, output_dx_origin, output_dx_dir, output_dx_weight, r1, r2, true);
-        camera_data->trace_ray_fw_thinlens(tries, input.sx, input_dx_sy, output_dy_origin, output_dy_dir, output_dy_weight, r1, r2, true);
-    } else if (camera_data->cameraType == PolynomialOptics){
-        camera_data->trace_ray_fw_po(tries, input_dx_sx, input.sy, output_dx_origin, output_dx_dir, output_dx_weight, r1, r2, true);
-        camera_data->trace_ray_fw_po(tries, input.sx, input_dx_sy, output_dy_origin, output_dy_dir, output_dy_weight, r1, r2, true);
-    }
-
-    output.dOdx = (output_dx_origin - origin) / step;
-    output.dOdy = (output_dy_origin - origin) / step;
-    output.dDdx = (output_dx_dir - direction) / step;
-    output.dDdy = (output_dy_dir - direction) / step;
-  // }
-  
+  camera_data->trace_ray_fw(tries, input.sx, input.sy, origin, direction, weight, r1, r2, &derivs);
+
+  output.dOdx = derivs.dOdsx * input.dsx;
+  output.dOdy = derivs.dOdsy * input.dsy;
+  output.dDdx = derivs.dDdsx * input.dsx;
+  output.dDdy = derivs.dDdsy * input.dsy;
   
   output.origin = origin;
   output.dir = direction;
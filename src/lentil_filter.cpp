@@ -36,7 +36,8 @@ node_update
   } else {
     AiFilterUpdate(node, 1.5);
   }
-  
+
+  lentil_complete_aov_setup(AiNodeGetUniverse(node));
 }
 
 
@@ -68,32 +69,35 @@ filter_pixel
   AtUniverse *universe = AiNodeGetUniverse(node);
   AtNode *camera_node = AiUniverseGetCamera(universe);
   Camera *camera_data = (Camera*)AiNodeGetLocalData(camera_node);
+  camera_data->complete_aov_setup_before_filtering(universe);
 
-  int aa_samples_set_by_user = AiNodeGetInt(AiUniverseGetOptions(universe), AtString("AA_samples"));
   bool rgba_aov = (AiAOVSampleIteratorGetAOVName(iterator) == camera_data->atstring_rgba); // early out for non-primary AOV samples
   bool adaptive_sampling = AiNodeGetBool(AiUniverseGetOptions(universe), AtString("enable_adaptive_sampling")); 
   float inverse_sample_density = 0.0;
 
+  // Progressive and IPR passes all add to the same redistribution buffers, which are only cleared when the render restarts.
+  // Within a pass samples are weighted by their inverse density, the pass as a whole by its sample count (AA^2),
+  // so every camera sample counts the same and the buffers converge like a single render with all samples of all passes.
+  // Passes below 1 AA sample are filtered in place, they are too coarse for the bokeh and carry little weight.
+  // Adaptive passes are weighted the same way: the inverse densities of the samples then sum to about 1 per pixel,
+  // so the samples of a pixel that got more of them in this pass share its weight.
+  float pass_weight = 1.0;
+  bool redistribution_pass = true;
+
   
   // count samples because I cannot rely on AiAOVSampleIteratorGetInvDensity() any longer since 7.0.0.0. It only works for adaptive sampling.
-  if (!adaptive_sampling && rgba_aov) {
+  if (rgba_aov) {
     int samples_counter = 0;
     while (AiAOVSampleIteratorGetNext(iterator)) ++samples_counter;
     AiAOVSampleIteratorReset(iterator);
     float AA_samples = std::sqrt(samples_counter) / camera_data->filter_width;
-    inverse_sample_density = 1.0/(AA_samples*AA_samples);
-    if (static_cast<int>(std::round(AA_samples)) != aa_samples_set_by_user || (aa_samples_set_by_user < 3)){
-      camera_data->redistribution = false; // skip when aa samples are below final AA samples
-    }
+    if (!adaptive_sampling) inverse_sample_density = 1.0/(AA_samples*AA_samples);
+    pass_weight = AA_samples*AA_samples;
+    if (static_cast<int>(std::round(AA_samples)) < 1) redistribution_pass = false;
   }
 
-
-  if (camera_data->redistribution && rgba_aov){
-    const double xres = (double)camera_data->xres;
-    const double yres = (double)camera_data->yres;
-    const double frame_aspect_ratio = (xres)/yres;
-    const double frame_aspect_ratio_without_region = (double)camera_data->xres_without_region/(double)camera_data->yres_without_region;
-
+  // an interrupted render (IPR restart) drops the redistribution of its remaining pixels
+  if (camera_data->redistribution && rgba_aov && !camera_data->render_interrupted()){
     int px, py;
     AiAOVSampleIteratorGetPixel(iterator, px, py);
     
@@ -101,16 +105,75 @@ filter_pixel
     py -= camera_data->region_min_y;
     AtShaderGlobals *shaderglobals = AiShaderGlobals();
 
+    // splat totals of this pixel for the frame budget, before and after scaling
+    uint64_t pixel_unscaled_splats = 0;
+    uint64_t pixel_splats = 0;
+
+    // time slice: once the pixel spent its budget, its remaining sources are filtered in place
+    const bool time_slice = camera_data->bidir_pixel_time_budget > 0.0;
+    const auto pixel_time_start = std::chrono::high_resolution_clock::now();
+    uint64_t pixel_time_sliced_sources = 0;
+    uint64_t pixel_redistributed_sources = 0;
+    uint64_t pixel_redistributed_splats = 0;
+    std::chrono::nanoseconds pixel_redistribution_time(0);
+
+    // applies the adaptive and frame budgets to the sample count of a source and redistributes it
+    auto redistribute_source = [&](RedistributionSample &rs, std::vector<std::map<float, float>> &crypto_cache,
+                                   std::vector<AtRGBA> &aov_values, const float luminance) {
+      if (time_slice && std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - pixel_time_start).count() > camera_data->bidir_pixel_time_budget) {
+        camera_data->filter_and_add_to_buffer_new(rs.px, rs.py, rs.depth, rs.iterator, crypto_cache, aov_values, rs.inverse_sample_density);
+        ++pixel_time_sliced_sources;
+        return;
+      }
+
+      int samples = rs.samples;
+
+      // adaptive mode: move the budget from converged tiles to noisy ones
+      if (camera_data->bidir_adaptive_threshold > 0.0) {
+        samples = std::ceil(samples * camera_data->splat_convergence.budget_scale(px, py, camera_data->bidir_adaptive_threshold));
+        samples = clamp(samples, 4, 2000);
+      }
+
+      // frame budget: scale the sample count so the frame lands on the requested total
+      if (camera_data->splat_budget.enabled()) {
+        pixel_unscaled_splats += samples;
+        samples = std::ceil(samples * camera_data->splat_budget.scale());
+        samples = clamp(samples, 4, 2000);
+        pixel_splats += samples;
+      }
+
+      rs.samples = samples;
+      rs.inv_samples = 1.0/static_cast<float>(samples);
+      for (auto &aov : camera_data->aovs){
+        if (aov.name == camera_data->atstring_lentil_debug) aov_values[aov.index] = samples;
+      }
+
+      // kernel specialised for the current camera configuration, selected in setup_filter()
+      SplatConvergence::Batch convergence_batch(luminance);
+      rs.convergence_batch = camera_data->bidir_adaptive_threshold > 0.0 ? &convergence_batch : nullptr;
+      const auto kernel_start = std::chrono::high_resolution_clock::now();
+      camera_data->redistribute(rs, crypto_cache, aov_values);
+      pixel_redistribution_time += std::chrono::high_resolution_clock::now() - kernel_start;
+      ++pixel_redistributed_sources;
+      pixel_redistributed_splats += samples;
+      if (rs.convergence_batch) camera_data->splat_convergence.add(convergence_batch);
+    };
+
+    // sources of this pixel that are merged before redistribution, when clustering is enabled
+    const bool clustering = camera_data->bidir_cluster_tolerance > 0.0;
+    std::vector<RedistributionCluster> clusters;
+
 
     for (int sampleid=0; AiAOVSampleIteratorGetNext(iterator)==true; sampleid++) {
-      bool redistribute = true;
+      bool redistribute = redistribution_pass;
 
       if (adaptive_sampling) {
         inverse_sample_density = AiAOVSampleIteratorGetInvDensity(iterator);
         
-        // skip AA < 3 (ipr passes, for example)
-        if (inverse_sample_density > 0.2) redistribute = false;
+        // skip AA < 1 (early ipr passes)
+        if (inverse_sample_density > 1.0) redistribute = false;
       }
+      const float sample_weight = inverse_sample_density * pass_weight; // weight in the accumulated buffers
 
       AtRGBA sample = AiAOVSampleIteratorGetRGBA(iterator);
       AtVector sample_pos_ws = AiAOVSampleIteratorGetAOVVec(iterator, camera_data->atstring_p);
@@ -131,6 +194,7 @@ filter_pixel
         redistribute = false;
         sample_is_from_skydome = true;
       }
+      if (camera_data->bidir_gather_luminance > 0.0) camera_data->record_pixel_depth(px, py, depth);
 
       AtRGB sample_volume = AiAOVSampleIteratorGetAOVRGB(iterator, AtString("volume"));
       bool volume_in_sample = AiColorMaxRGB(sample_volume) > 0.0;
@@ -141,13 +205,7 @@ filter_pixel
       float time = AiAOVSampleIteratorGetAOVFlt(iterator, camera_data->atstring_time);
       AtMatrix cam_to_world; AiCameraToWorldMatrix(camera_data->camera_node, time, cam_to_world);
       AtMatrix world_to_camera_matrix; AiWorldToCameraMatrix(camera_data->camera_node, time, world_to_camera_matrix);
-      AtVector camera_space_sample_position = AiM4PointByMatrixMult(world_to_camera_matrix, sample_pos_ws);
-      switch (camera_data->unitModel){
-        case mm: { camera_space_sample_position *= 0.1; } break;
-        case cm: { camera_space_sample_position *= 1.0; } break;
-        case dm: { camera_space_sample_position *= 10.0;} break;
-        case m:  { camera_space_sample_position *= 100.0;}
-      }
+      AtVector camera_space_sample_position = AiM4PointByMatrixMult(world_to_camera_matrix, sample_pos_ws) / camera_data->unit_scale; // to cm
       
       const AtRGBA sample_transmission = AiAOVSampleIteratorGetAOVRGBA(iterator, camera_data->atstring_transmission);
       bool transmitted_energy_in_sample = camera_data->enable_bidir_transmission ? false : (AiColorMaxRGB(sample_transmission) > 0.0);
@@ -185,6 +243,10 @@ filter_pixel
         redistribute = false; // don't redistribute under certain CoC size, emperically tested
         // mix = circle_of_confusion * 2.5; // hardcoded to 0.4, change!
       }
+
+      // hybrid mode: only highlights get the exact redistribution, dim defocused samples are blurred by the imager
+      const bool gather_blur = redistribute && camera_data->bidir_gather_luminance > 0.0 && sample_luminance < camera_data->bidir_gather_luminance;
+      if (gather_blur) redistribute = false;
       
       // disable mixing when necessary
       // if (sample_is_from_skydome && !camera_data->enable_skydome) {
@@ -194,22 +256,16 @@ filter_pixel
       // if (volume_in_sample) mix = 0.0;
 
 
-      int samples = std::ceil(coc_squared_pixels * inverse_sample_density); // aa_sample independence
+      const float splat_demand = coc_squared_pixels * inverse_sample_density; // aa_sample independence
+      int samples = std::ceil(splat_demand);
       samples = clamp(samples, 4, 2000);
-      float inv_samples = 1.0/static_cast<float>(samples);
-
-      unsigned int total_samples_taken = 0;
-      unsigned int max_total_samples = samples*5;
 
 
       // store all aov values
       std::vector<AtRGBA> aov_values(camera_data->aovcount, AI_RGBA_ZERO);
       for (auto &aov : camera_data->aovs){
         if (aov.is_crypto) continue;
-        if (aov.name == camera_data->atstring_lentil_debug){
-          aov_values[aov.index] = samples * redistribute;
-          continue;
-        }
+        if (aov.name == camera_data->atstring_lentil_debug) continue; // sample count, filled in when redistributed
 
         switch(aov.type){
           case AI_TYPE_RGBA: {
@@ -234,220 +290,56 @@ filter_pixel
       }
 
 
-      switch (camera_data->cameraType){
-        case PolynomialOptics:
-        { 
-          if (std::abs(camera_space_sample_position.z) < (camera_data->lens_length*0.1)) redistribute = false; // sample can't be inside of lens
-
-          // early out
-          if (redistribute == false){
-            camera_data->filter_and_add_to_buffer_new(px, py, depth, iterator, crypto_cache, aov_values, inverse_sample_density);
-            continue;
-          }
-
-          for(int count=0; count<samples && total_samples_taken < max_total_samples; ++count, ++total_samples_taken) {
-            
-            Eigen::Vector2d sensor_position(0, 0);            
-            Eigen::Vector3d camera_space_sample_position_eigen(camera_space_sample_position.x, camera_space_sample_position.y, camera_space_sample_position.z);
-
-            AtRGB rgb_weight = AI_RGB_WHITE;
-            float lambda_per_sample = 0.55;
-            for (int channel = -1; channel <= 1; channel++) {
-              AtRGB rgb_weight = AI_RGB_WHITE;
-              if (camera_data->abb_chromatic > 0.0) {
-                if (channel == -1){
-                  rgb_weight = AtRGB(3,0,0);
-                  lambda_per_sample = linear_interpolate(1.0-camera_data->abb_chromatic, 0.35, 0.55);
-                } else if (channel == 0) {
-                  rgb_weight = AtRGB(0,3,0);
-                  lambda_per_sample = 0.55;
-                } else if (channel == 1) {
-                  rgb_weight = AtRGB(0,0,3);
-                  lambda_per_sample = linear_interpolate(camera_data->abb_chromatic, 0.55, 0.85);
-                }
-              } else if (camera_data->abb_chromatic == 0.0 && channel > -1) continue; // skip when no CA is used
-              
-
-              if(!camera_data->trace_ray_bw_po(-camera_space_sample_position_eigen*10.0, sensor_position, px, py, total_samples_taken, cam_to_world, sample_pos_ws, shaderglobals, lambda_per_sample, sample_is_from_skydome)) {
-                --count;
-                continue;
-              }
-
-              const Eigen::Vector2d s(sensor_position(0) / (camera_data->sensor_width * 0.5), sensor_position(1) / (camera_data->sensor_width * 0.5) * frame_aspect_ratio_without_region);
-              const Eigen::Vector2d pixel(((( s(0) + 1.0) / 2.0) * camera_data->xres_without_region) - camera_data->region_min_x, 
-                                          (((-s(1) + 1.0) / 2.0) * camera_data->yres_without_region) - camera_data->region_min_y);
-          
-
-              // if outside of image
-              if ((pixel(0) >= xres) || (pixel(0) < 0) || (pixel(1) >= yres) || (pixel(1) < 0) ||
-                  (pixel(0) != pixel(0)) || (pixel(1) != pixel(1))) // nan checking
-              {
-                --count; // much room for improvement here, potentially many samples are wasted outside of frame
-                continue;
-              }
-
-              // unsigned pixelnumber = camera_data->coords_to_linear_pixel(floor(pixel(0)), floor(pixel(1)));
-              unsigned pixelnumber = redistribute ? camera_data->coords_to_linear_pixel(floor(pixel(0)), floor(pixel(1))) : camera_data->coords_to_linear_pixel(px, py);
-
-              // box filtering, see thin-lens
-              float filter_weight = 1.0;
-
-              for (auto &aov : camera_data->aovs){
-                  if (aov.is_crypto) camera_data->add_to_buffer_cryptomatte(aov, pixelnumber, crypto_cache[aov.index], inverse_sample_density * inv_samples);
-                  else camera_data->add_to_buffer(aov, pixelnumber, aov_values[aov.index], fitted_bidir_add_energy, depth, iterator, filter_weight * inverse_sample_density * inv_samples, rgb_weight); 
-              }
-            }
-          }
-        } break;
-
-        case ThinLens:
-        {
-          // early out
-          if (redistribute == false){
-            camera_data->filter_and_add_to_buffer_new(px, py, depth, iterator, crypto_cache, aov_values, inverse_sample_density);
-            continue;
-          }
-
-          for(int count=0; count<samples && total_samples_taken<max_total_samples; ++count, ++total_samples_taken) {
-            unsigned int seed = tea<8>((px*py+px), total_samples_taken);
-            
-            float image_dist_samplepos = (-camera_data->focal_length * camera_space_sample_position.z) / (-camera_data->focal_length + camera_space_sample_position.z);
-
-            // either get uniformly distributed points on the unit disk or bokeh image
-            Eigen::Vector2d unit_disk(0, 0);
-            if (camera_data->bokeh_enable_image) camera_data->image.bokehSample(rng(seed),rng(seed), unit_disk, rng(seed), rng(seed));
-            else if (camera_data->bokeh_aperture_blades < 2) concentricDiskSample(rng(seed),rng(seed), unit_disk, camera_data->abb_spherical, camera_data->circle_to_square, camera_data->bokeh_anamorphic);
-            else camera_data->lens_sample_triangular_aperture(unit_disk(0), unit_disk(1), rng(seed),rng(seed), 1.0, camera_data->bokeh_aperture_blades);
-
-            unit_disk(0) *= camera_data->bokeh_anamorphic;
-            AtVector lens(unit_disk(0) * camera_data->aperture_radius, unit_disk(1) * camera_data->aperture_radius, 0.0);
-
-
-            // ray through center of lens
-            AtVector dir_from_center = AiV3Normalize(camera_space_sample_position);
-            AtVector dir_lens_to_P = AiV3Normalize(camera_space_sample_position - lens);
-
-            // perturb ray direction to simulate coma aberration
-            // todo: the bidirectional case isn't entirely the same as the forward case.. fix!
-            // current strategy is to perturb the initial sample position by doing the same ray perturbation i'm doing in the forward case
-            float abb_coma_multiplied = camera_data->abb_coma * abb_coma_multipliers(camera_data->sensor_width, camera_data->focal_length, dir_from_center, unit_disk);
-            dir_lens_to_P = abb_coma_perturb(dir_lens_to_P, dir_from_center, abb_coma_multiplied, true);
-
-            AtVector camera_space_sample_position_perturbed = AiV3Length(camera_space_sample_position) * dir_lens_to_P;
-            dir_from_center = AiV3Normalize(camera_space_sample_position_perturbed);
-
-            float samplepos_image_intersection = std::abs(image_dist_samplepos/dir_from_center.z);
-            AtVector samplepos_image_point = dir_from_center * samplepos_image_intersection;
-
-
-            // depth of field
-            AtVector dir_from_lens_to_image_sample = AiV3Normalize(samplepos_image_point - lens);
-            
-
-            // calculate sensor point of unperturbed ray for multiplying the chromatic abberation (less in center, more at edges)
-            float focusdist_intersection_unperturbed = std::abs(camera_data->get_image_dist_focusdist_thinlens()/dir_from_lens_to_image_sample.z);
-            AtVector focusdist_image_point_uperturbed = lens + dir_from_lens_to_image_sample*focusdist_intersection_unperturbed;
-            AtVector2 sensor_position_unperturbed(focusdist_image_point_uperturbed.x / focusdist_image_point_uperturbed.z,
-                                                  focusdist_image_point_uperturbed.y / focusdist_image_point_uperturbed.z);
-            const AtVector2 p2(lens.x, lens.y);
-            const float distance_to_center_unperturbed = AiV2Dist(AtVector2(0.0, 0.0), sensor_position_unperturbed);
-
-             // raytrace for scene/geometrical occlusions along the ray
-            AtVector lens_correct_scaled = lens;
-            switch (camera_data->unitModel){
-              case mm: { lens_correct_scaled /= 0.1; } break;
-              case cm: { lens_correct_scaled /= 1.0; } break;
-              case dm: { lens_correct_scaled /= 10.0;} break;
-              case m:  { lens_correct_scaled /= 100.0;}
-            }
-            AtVector cam_pos_ws = AiM4PointByMatrixMult(cam_to_world, lens_correct_scaled);
-            AtVector ws_direction = AiV3Normalize(cam_pos_ws - sample_pos_ws);
-            AtRay ray = AiMakeRay(AI_RAY_UNDEFINED, sample_pos_ws, &ws_direction, AiV3Dist(cam_pos_ws, sample_pos_ws), shaderglobals);
-            AtScrSample hit = AtScrSample();
-            // if (AiTrace(ray, AI_RGB_WHITE, hit) && !sample_is_from_skydome){
-            if (AiTraceProbe(ray, shaderglobals) && !sample_is_from_skydome){
-              // if (hit.point.x != 0.0) AiMsgInfo("hit.point: %f %f %f", hit.point.x, hit.point.y, hit.point.z);
-              // if (hit.opacity != AI_RGB_WHITE) AiMsgInfo("hit.opacity: %f %f %f", hit.opacity.r, hit.opacity.g, hit.opacity.b);
-              //   AiMsgInfo("uhoh");
-              // }
-              --count;
-              continue;
-            }
-
-
-            // optical vignetting
-            if (camera_data->optical_vignetting_distance > 0.0){
-              dir_lens_to_P = AiV3Normalize(camera_space_sample_position_perturbed - lens);
-              // if (image_dist_samplepos<image_dist_focusdist) lens *= -1.0; // this really shouldn't be the case.... also no way i can do that in forward tracing?
-              if (!empericalOpticalVignettingSquare(lens, dir_lens_to_P, camera_data->aperture_radius, camera_data->optical_vignetting_radius, camera_data->optical_vignetting_distance, lerp_squircle_mapping(camera_data->circle_to_square))){
-                  --count;
-                  continue;
-              }
-            }
-
-
-            float focusdist_intersection = std::abs(camera_data->get_image_dist_focusdist_thinlens()/dir_from_lens_to_image_sample.z);
-
-
-            AtRGB rgb_weight = AI_RGB_WHITE;
-            if (camera_data->abb_chromatic > 0.0) {
-              const float abb_chromatic_lateral = 5.0;
-
-              // const int channel = static_cast<int>(rng(seed)*3) - 1; // seems to have correlation issues here, what am i doing wrong? visible with low coc radii... This rng is much faster, and has a significant impact on rendertime.. see how i can re-introduce this?
-              const int channel = static_cast<int>(std::floor((xor128() / 4294967296.0) * 3.0)) - 1;
-              if (channel == -1) rgb_weight = AtRGB(3,0,0);
-              else if (channel == 0) rgb_weight = AtRGB(0,3,0);
-              else if (channel == 1) rgb_weight = AtRGB(0,0,3);
-
-              // add some shifting to the focus distance (chromatic abb)
-              // abs(channel) -> green/magenta shift, channel -> red/cyan shift
-              float direction_shift = camera_data->abb_chromatic_type == green_magenta ? std::abs(channel) : channel; // TODO: possible optimization when using green/magenta, since two channels are a copy of each other
-              focusdist_intersection = std::abs(camera_data->get_image_dist_focusdist_thinlens_abberated(direction_shift*camera_data->abb_chromatic*abb_chromatic_lateral*distance_to_center_unperturbed)/dir_from_lens_to_image_sample.z);
-            }
-            
-              
-            AtVector focusdist_image_point = lens + dir_from_lens_to_image_sample*focusdist_intersection;
-
-
-            // bring back to (x, y, 1)
-            AtVector2 sensor_position(focusdist_image_point.x / focusdist_image_point.z,
-                                      focusdist_image_point.y / focusdist_image_point.z);
-            // transform to screenspace coordinate mapping
-            sensor_position /= (camera_data->sensor_width*0.5)/-camera_data->focal_length;
-
-
-            // barrel distortion (inverse)
-            if (camera_data->abb_distortion > 0.0) sensor_position = inverseBarrelDistortion(AtVector2(sensor_position.x, sensor_position.y), camera_data->abb_distortion);
-            
-
-            // convert sensor position to pixel position
-            Eigen::Vector2d s(sensor_position.x, sensor_position.y * frame_aspect_ratio_without_region);
-            const float pixel_x = ((( s(0) + 1.0) / 2.0) * camera_data->xres_without_region) - camera_data->region_min_x;
-            const float pixel_y = (((-s(1) + 1.0) / 2.0) * camera_data->yres_without_region) - camera_data->region_min_y;
-
-            // if outside of image
-            if ((pixel_x >= xres) || (pixel_x < 0) || (pixel_y >= yres) || (pixel_y < 0)) {
-              --count; // much room for improvement here, potentially many samples are wasted outside of frame, could keep track of a bbox
-              continue;
-            }
-
-            unsigned pixelnumber = redistribute ? camera_data->coords_to_linear_pixel(floor(pixel_x), floor(pixel_y)) : camera_data->coords_to_linear_pixel(px, py);
-
-            // couldn't get gaussian filtering to work yet... so box filtering for now.
-            // AtVector2 offset_from_pixel_center(std::abs(0.5 - fmod(pixel_x, 1)), std::abs(0.5 - fmod(pixel_y, 1)));
-            // float filter_weight = camera_data->filter_weight_gaussian(offset_from_pixel_center, 2.0);
-            // if (filter_weight == 0) continue;
-            float filter_weight = 1.0;
-
-            for (auto &aov : camera_data->aovs){
-                if (aov.is_crypto) camera_data->add_to_buffer_cryptomatte(aov, pixelnumber, crypto_cache[aov.index], inverse_sample_density * inv_samples);
-                else camera_data->add_to_buffer(aov, pixelnumber, aov_values[aov.index], fitted_bidir_add_energy, depth, iterator, filter_weight * inverse_sample_density * inv_samples, rgb_weight); 
-            }
-          }
-        } break;
+      // early out
+      if (redistribute == false){
+        if (gather_blur) {
+          const float coc_radius_pixels = 0.5 * circle_of_confusion / camera_data->sensor_width * camera_data->xres_without_region;
+          camera_data->add_to_gather_buffers(px, py, depth, coc_radius_pixels, iterator, crypto_cache, aov_values, sample_weight);
+        }
+        else camera_data->filter_and_add_to_buffer_new(px, py, depth, iterator, crypto_cache, aov_values, sample_weight);
+        continue;
+      }
+
+      RedistributionSample rs;
+      rs.px = px;
+      rs.py = py;
+      rs.camera_space_position = camera_space_sample_position;
+      rs.world_space_position = sample_pos_ws;
+      rs.cam_to_world = cam_to_world;
+      rs.depth = depth;
+      rs.is_from_skydome = sample_is_from_skydome;
+      rs.samples = samples;
+      rs.inverse_sample_density = sample_weight;
+      rs.inv_samples = 1.0/static_cast<float>(samples);
+      rs.fitted_bidir_add_energy = fitted_bidir_add_energy;
+      rs.bokeh_level = camera_data->bokeh_enable_image ? camera_data->image.levelForCoc(circle_of_confusion / camera_data->sensor_width * camera_data->xres_without_region) : 0;
+      const AtVector2 &subpixel_offset = AiAOVSampleIteratorGetOffset(iterator);
+      rs.sampling_seed = pcg_hash(random_key(px, py, subpixel_offset.x, subpixel_offset.y) ^ sampleid);
+      rs.iterator = iterator;
+      rs.sg = shaderglobals;
+
+      if (clustering) {
+        const float coc_radius_pixels = 0.5 * circle_of_confusion / camera_data->sensor_width * camera_data->xres_without_region;
+        camera_data->cluster_redistribution_sample(clusters, rs, crypto_cache, aov_values, sample, subpixel_offset, time,
+                                                   coc_radius_pixels, splat_demand, sample_luminance, sampleid);
+        continue;
       }
+
+      redistribute_source(rs, crypto_cache, aov_values, sample_luminance);
+    }
+
+    for (auto &cluster : clusters) {
+      camera_data->reset_iterator_to_id(iterator, cluster.sampleid);
+      redistribute_source(cluster.rs, cluster.crypto_cache, cluster.aov_values, cluster.luminance);
     }
     AiShaderGlobalsDestroy(shaderglobals);
+    if (camera_data->splat_budget.enabled() && redistribution_pass) camera_data->splat_budget.add_pixel(pixel_unscaled_splats, pixel_splats);
+    if (pixel_time_sliced_sources > 0) camera_data->time_sliced_sources.fetch_add(pixel_time_sliced_sources, std::memory_order_relaxed);
+    if (pixel_redistributed_sources > 0) {
+      camera_data->redistributed_sources.fetch_add(pixel_redistributed_sources, std::memory_order_relaxed);
+      camera_data->redistributed_splats.fetch_add(pixel_redistributed_splats, std::memory_order_relaxed);
+      camera_data->redistribution_nanoseconds.fetch_add(pixel_redistribution_time.count(), std::memory_order_relaxed);
+    }
   } 
   
 
@@ -36,6 +36,8 @@ node_update {
     AtRenderSession *render_session_duplicate = AiUniverseGetRenderSession(universe);
     AiRenderSetHintInt(render_session_duplicate, AtString("imager_padding"), 0);
     AiRenderSetHintInt(render_session_duplicate, AtString("imager_schedule"), 0x02); // SEEMS TO CAUSE ISSUES WITH NEGATIVE RENDER REGIONS    
+
+    lentil_complete_aov_setup(universe);
 }
  
 driver_supports_pixel_type 
@@ -81,6 +83,18 @@ driver_process_bucket {
   }
 
 
+  if (!camera_data->imager_print_once_only) {
+    camera_data->visibility_stats.report();
+    camera_data->report_pixel_time_budget();
+    camera_data->report_redistribution();
+  }
+
+  lentil_crit_sec_enter();
+  camera_data->resolve_gather_blur();
+  camera_data->splat_budget.end_pass();
+  lentil_crit_sec_leave();
+
+
   const AtString crypto_material00 = AtString("crypto_material00");
   const AtString crypto_material01 = AtString("crypto_material01");
   const AtString crypto_material02 = AtString("crypto_material02");
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+
+// Colour of a single wavelength, for the spectral (hero wavelength) chromatic aberration of the polynomial optics.
+// The CIE 1931 colour matching functions (multi-lobe gaussian fit of Wyman, Sloan & Shirley 2013) are converted
+// to linear sRGB, clamped to the gamut and tabulated over the visible range. Every channel is normalized to an
+// average of 1, so uniformly sampled wavelengths weighted by this table add up to white.
+// Wavelengths are in micrometers, like the polynomials.
+class SpectralToRgb {
+public:
+    static const int table_size = 64;
+    static constexpr double lambda_min = 0.38;
+    static constexpr double lambda_max = 0.78;
+
+    SpectralToRgb() {
+        double mean[3] = {0.0, 0.0, 0.0};
+        for (int i = 0; i <= table_size; ++i) {
+            const double nm = 1000.0 * (lambda_min + (lambda_max - lambda_min) * i / table_size);
+            const double x = 1.056*lobe(nm, 599.8, 37.9, 31.0) + 0.362*lobe(nm, 442.0, 16.0, 26.7) - 0.065*lobe(nm, 501.1, 20.4, 26.2);
+            const double y = 0.821*lobe(nm, 568.8, 46.9, 40.5) + 0.286*lobe(nm, 530.9, 16.3, 31.1);
+            const double z = 1.217*lobe(nm, 437.0, 11.8, 36.0) + 0.681*lobe(nm, 459.0, 26.0, 13.8);
+
+            rgb[i][0] = std::max( 3.2404542*x - 1.5371385*y - 0.4985314*z, 0.0);
+            rgb[i][1] = std::max(-0.9692660*x + 1.8760108*y + 0.0415560*z, 0.0);
+            rgb[i][2] = std::max( 0.0556434*x - 0.2040259*y + 1.0572252*z, 0.0);
+
+            // trapezoidal average over the range
+            const double w = (i == 0 || i == table_size) ? 0.5 : 1.0;
+            for (int c = 0; c < 3; ++c) mean[c] += w * rgb[i][c] / table_size;
+        }
+
+        for (int i = 0; i <= table_size; ++i) {
+            for (int c = 0; c < 3; ++c) rgb[i][c] /= mean[c];
+        }
+    }
+
+    inline AtRGB operator()(const double wavelength) const {
+        const double pos = std::min(std::max((wavelength - lambda_min) / (lambda_max - lambda_min), 0.0), 1.0) * table_size;
+        const int i = std::min(static_cast<int>(pos), table_size - 1);
+        const double f = pos - i;
+        return AtRGB(rgb[i][0] + f * (rgb[i+1][0] - rgb[i][0]),
+                     rgb[i][1] + f * (rgb[i+1][1] - rgb[i][1]),
+                     rgb[i][2] + f * (rgb[i+1][2] - rgb[i][2]));
+    }
+
+    // N wavelengths stratified over the visible range from a single random number:
+    // the hero wavelength is picked by u, the others are rotated by 1/N of the range.
+    template<int N>
+    static inline void hero_wavelengths(const double u, double (&wavelengths)[N]) {
+        for (int i = 0; i < N; ++i) {
+            double t = u + static_cast<double>(i) / N;
+            t -= std::floor(t);
+            wavelengths[i] = lambda_min + (lambda_max - lambda_min) * t;
+        }
+    }
+
+private:
+    double rgb[table_size + 1][3];
+
+    // asymmetric gaussian, with a different width left and right of the peak
+    static inline double lobe(const double x, const double mu, const double sigma_left, const double sigma_right) {
+        const double t = (x - mu) / (x < mu ? sigma_left : sigma_right);
+        return std::exp(-0.5 * t * t);
+    }
+};
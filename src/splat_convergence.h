@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+
+// running mean and variance (Welford), batches are merged with the parallel update of Chan et al.
+struct RunningVariance {
+    double count = 0.0;
+    double mean = 0.0;
+    double m2 = 0.0;
+
+    void add(const double value, const double weight = 1.0) {
+        merge(weight, value, 0.0);
+    }
+
+    void merge(const double other_count, const double other_mean, const double other_m2) {
+        if (other_count <= 0.0) return;
+        const double total = count + other_count;
+        const double delta = other_mean - mean;
+        mean += delta * other_count / total;
+        m2 += other_m2 + delta * delta * count * other_count / total;
+        count = total;
+    }
+
+    double variance() const { return count > 1.0 ? m2 / (count - 1.0) : 0.0; }
+};
+
+
+// Convergence of the redistributed energy per tile of the frame, for the adaptive splat budget.
+// Every tile keeps the mean and variance of the energy of the splats that landed in it, and the number of source samples
+// they came from. The splats of one source share its colour and are far from independent, so the source samples are
+// the unit of the error: the relative error of a tile is that of a sum over its sources of contributions with the
+// splats' mean and variance, sqrt((variance + mean^2) / sources) / mean. It keeps falling as sources arrive and
+// doesn't drop to zero on flat regions.
+// Noisy tiles keep their full budget (up to twice as much), converged tiles give theirs up.
+class SplatConvergence {
+public:
+    static const int tile_size = 16;
+    static constexpr double min_sources = 16.0; // below this the tile statistics aren't trusted yet
+
+    // splats of one source sample, per destination tile, gathered while it is redistributed and merged once it is done
+    class Batch {
+    public:
+        explicit Batch(const double luminance_in) : luminance(luminance_in) {}
+
+        const double luminance; // of the source sample, the splats carry it scaled by their weight
+
+    private:
+        friend class SplatConvergence;
+        struct Entry { int tile; RunningVariance energy; };
+        std::vector<Entry> entries; // a circle of confusion covers a few tiles, a linear search is enough
+    };
+
+    void reset(const int xres, const int yres) {
+        tiles_x = (xres + tile_size - 1) / tile_size;
+        tiles_y = (yres + tile_size - 1) / tile_size;
+        tiles.assign(tiles_x * tiles_y, Tile());
+        locks = std::vector<std::mutex>(tiles.size());
+    }
+
+    void clear() {
+        tiles.clear();
+        locks.clear();
+        tiles_x = tiles_y = 0;
+    }
+
+    // multiplier on the splat budget of a source sample at pixel (px, py), for a relative noise target
+    double budget_scale(const int px, const int py, const double threshold) {
+        const int tile = tile_index(px, py);
+        if (tile < 0 || threshold <= 0.0) return 1.0;
+
+        Tile stats;
+        {
+            std::lock_guard<std::mutex> lock(locks[tile]);
+            stats = tiles[tile];
+        }
+        if (stats.sources < min_sources || stats.energy.mean <= 0.0) return 1.0;
+
+        const double second_moment = stats.energy.variance() + stats.energy.mean * stats.energy.mean;
+        const double relative_error = std::sqrt(second_moment / stats.sources) / stats.energy.mean;
+        return std::min(std::max(relative_error / threshold, 0.25), 2.0);
+    }
+
+    // a splat of the batch's source with the given weight landed on pixel (px, py)
+    void deposit(Batch &batch, const int px, const int py, const double weight) const {
+        const int tile = tile_index(px, py);
+        if (tile < 0) return;
+
+        auto entry = std::find_if(batch.entries.begin(), batch.entries.end(), [tile](const Batch::Entry &e){ return e.tile == tile; });
+        if (entry == batch.entries.end()) entry = batch.entries.insert(batch.entries.end(), Batch::Entry{tile, RunningVariance()});
+        entry->energy.add(batch.luminance * weight);
+    }
+
+    // merges the splats of a redistributed source sample into the tiles they landed in
+    void add(const Batch &batch) {
+        for (const Batch::Entry &entry : batch.entries) {
+            std::lock_guard<std::mutex> lock(locks[entry.tile]);
+            Tile &tile = tiles[entry.tile];
+            tile.energy.merge(entry.energy.count, entry.energy.mean, entry.energy.m2);
+            tile.sources += 1.0;
+        }
+    }
+
+private:
+    struct Tile {
+        RunningVariance energy; // per splat
+        double sources = 0.0;
+    };
+
+    int tiles_x = 0;
+    int tiles_y = 0;
+    std::vector<Tile> tiles;
+    std::vector<std::mutex> locks;
+
+    int tile_index(const int px, const int py) const {
+        const int tx = px / tile_size;
+        const int ty = py / tile_size;
+        if (px < 0 || py < 0 || tx >= tiles_x || ty >= tiles_y) return -1;
+        return ty * tiles_x + tx;
+    }
+};
+
+
+// Splat budget of a render pass. Every progressive or IPR pass that redistributes lands on the budget on its own,
+// a batch render has a single pass. The first pixels of a pass that redistribute (the first buckets) act as its prepass:
+// their unscaled splat counts are extrapolated to the whole frame, after which every sample count of the pass is scaled
+// so that the pass lands on the budget. Totals are kept for the predicted versus actual report at the end of the pass.
+class FrameSplatBudget {
+public:
+    static constexpr double prepass_fraction = 0.02; // of the frame's pixels
+    static const int prepass_min_pixels = 4096;
+
+    void reset(const double budget_in, const int frame_pixels_in) {
+        budget = budget_in;
+        frame_pixels = frame_pixels_in;
+        prepass_pixels = std::min(frame_pixels, std::max(prepass_min_pixels, static_cast<int>(frame_pixels * prepass_fraction)));
+        pass = 0;
+        start_pass();
+    }
+
+    bool enabled() const { return budget > 0.0; }
+
+    // multiplier on the sample counts, 1 until the prepass of the current pass is done
+    double scale() const {
+        return ready.load(std::memory_order_acquire) ? scale_value : 1.0;
+    }
+
+    // totals of a pixel that was redistributed: the sample counts before and after the budget was applied.
+    // pixels of passes that are filtered in place don't count, they would predict a pass without any splats.
+    void add_pixel(const uint64_t pixel_unscaled_splats, const uint64_t pixel_splats) {
+        unscaled_splats.fetch_add(pixel_unscaled_splats, std::memory_order_relaxed);
+        splats.fetch_add(pixel_splats, std::memory_order_relaxed);
+        const int seen = pixels.fetch_add(1, std::memory_order_relaxed) + 1;
+
+        // exactly one thread crosses the prepass size and makes the prediction
+        if (seen != prepass_pixels) return;
+        predicted_unscaled = static_cast<double>(unscaled_splats.load(std::memory_order_relaxed)) / seen * frame_pixels;
+        if (predicted_unscaled > 0.0) scale_value = std::min(std::max(budget / predicted_unscaled, 0.01), 100.0);
+        ready.store(true, std::memory_order_release);
+    }
+
+    // called by the imager once the pass is filtered: reports the pass and starts the prediction over for the next one.
+    // the imager can run more than once per pass, a pass without redistributed pixels is skipped.
+    void end_pass() {
+        if (!enabled() || pixels.load() == 0) return;
+        ++pass;
+        report();
+        start_pass();
+    }
+
+private:
+    double budget = 0.0;
+    int frame_pixels = 0;
+    int prepass_pixels = 0;
+    int pass = 0;
+    double scale_value = 1.0;
+    double predicted_unscaled = 0.0;
+    std::atomic<int> pixels{0};
+    std::atomic<uint64_t> unscaled_splats{0};
+    std::atomic<uint64_t> splats{0};
+    std::atomic<bool> ready{false};
+
+    void start_pass() {
+        scale_value = 1.0;
+        predicted_unscaled = 0.0;
+        pixels.store(0);
+        unscaled_splats.store(0);
+        splats.store(0);
+        ready.store(false);
+    }
+
+    void report() const {
+        if (!ready.load(std::memory_order_acquire)) {
+            AiMsgInfo("[LENTIL BIDIRECTIONAL] splat budget, pass %d: pass ended before the prepass (%d of %d pixels), %.2fM splats unscaled",
+                      pass, pixels.load(), prepass_pixels, splats.load() * 1e-6);
+            return;
+        }
+        AiMsgInfo("[LENTIL BIDIRECTIONAL] splat budget %.2fM, pass %d: predicted %.2fM splats without budget (actual %.2fM), scaled by %.3f to %.2fM splats",
+                  budget * 1e-6, pass, predicted_unscaled * 1e-6, unscaled_splats.load() * 1e-6, scale_value, splats.load() * 1e-6);
+    }
+};
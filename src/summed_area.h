@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <future>
+#include <thread>
+#include <vector>
+
+
+// runs f(i) for i in [0, count), split in one contiguous range per hardware thread
+template<typename F>
+inline void parallel_for_range(const int count, F &&f) {
+    const int threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    const int chunk = std::max(1, (count + threads - 1) / threads);
+
+    std::vector<std::future<void>> tasks;
+    for (int begin = 0; begin < count; begin += chunk) {
+        const int end = std::min(count, begin + chunk);
+        tasks.push_back(std::async(std::launch::async, [&f, begin, end]{
+            for (int i = begin; i < end; ++i) f(i);
+        }));
+    }
+    for (auto &task : tasks) task.get();
+}
+
+
+// Summed area table of a per pixel value with a few channels, any rectangle sum is then four lookups.
+// Covers the window [x0, x0+width) x [y0, y0+height) of the frame, lookups are in frame coordinates.
+// Kept in double, the sums over a whole frame lose too much precision in float.
+template<int Channels>
+class SummedAreaTable {
+public:
+    // value(x, y, out) writes the Channels values of frame pixel (x, y)
+    template<typename Value>
+    void build(const int x0_in, const int y0_in, const int width_in, const int height_in, Value &&value) {
+        x0 = x0_in;
+        y0 = y0_in;
+        width = width_in;
+        height = height_in;
+        stride = (width + 1) * Channels;
+        table.assign(static_cast<size_t>(stride) * (height + 1), 0.0);
+
+        // prefix sums along the rows, then down the columns (in blocks of columns, so the rows stay in cache)
+        parallel_for_range(height, [&](const int y){
+            double *row = &table[static_cast<size_t>(y + 1) * stride];
+            double sum[Channels] = {};
+            double pixel[Channels];
+            for (int x = 0; x < width; ++x) {
+                value(x0 + x, y0 + y, pixel);
+                for (int c = 0; c < Channels; ++c) {
+                    sum[c] += pixel[c];
+                    row[(x + 1) * Channels + c] = sum[c];
+                }
+            }
+        });
+
+        const int block = 64 * Channels;
+        parallel_for_range((stride + block - 1) / block, [&](const int b){
+            const int i_end = std::min(stride, (b + 1) * block);
+            for (int y = 2; y <= height; ++y) {
+                double *row = &table[static_cast<size_t>(y) * stride];
+                const double *above = row - stride;
+                for (int i = b * block; i < i_end; ++i) row[i] += above[i];
+            }
+        });
+    }
+
+    // adds the sum over the inclusive frame rectangle [xa, xb] x [ya, yb], clipped to the window, to out
+    inline void add_sum(int xa, int ya, int xb, int yb, double (&out)[Channels]) const {
+        xa = std::max(xa - x0, 0);
+        ya = std::max(ya - y0, 0);
+        xb = std::min(xb - x0, width - 1);
+        yb = std::min(yb - y0, height - 1);
+        if (xa > xb || ya > yb) return;
+
+        const double *top = &table[static_cast<size_t>(ya) * stride];
+        const double *bottom = &table[static_cast<size_t>(yb + 1) * stride];
+        const int left = xa * Channels;
+        const int right = (xb + 1) * Channels;
+        for (int c = 0; c < Channels; ++c) out[c] += bottom[right + c] - bottom[left + c] - top[right + c] + top[left + c];
+    }
+
+private:
+    int x0 = 0;
+    int y0 = 0;
+    int width = 0;
+    int height = 0;
+    int stride = 0;
+    std::vector<double> table;
+};
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+
+// Occlusion of the lens as seen from a single source sample, shared by all of its splats.
+// The unit aperture is split in 4x4 regions. The first time a splat lands in a region, the region is probed on a 3x3
+// lattice (its corners, edge midpoints and centre), with every point pulled inside the aperture disc. The lattice points
+// are shared with the neighbouring regions. A region whose 9 probes agree is taken as uniformly visible (or occluded)
+// and answers every splat that lands in it. Any disagreement makes it a boundary region, which falls back to an exact
+// probe per splat. An occluder thinner than the lattice spacing can still be missed, so the cache is off by default.
+// Only worth it for sources with many splats, below min_splats every test is an exact probe.
+class ApertureVisibilityCache {
+public:
+    static const int regions = 4;
+    static const int min_splats = 256;
+
+    explicit ApertureVisibilityCache(const bool enabled_in) : enabled(enabled_in) {}
+
+    // (x, y) on the unit aperture, probe(x, y) traces the shadow ray to that point and returns true when it is unblocked
+    template<typename Probe>
+    inline bool visible(const double x, const double y, Probe &&probe) {
+        if (!enabled) return exact(x, y, probe);
+
+        const int rx = region_index(x);
+        const int ry = region_index(y);
+        State &state = regions_state[ry * regions + rx];
+
+        if (state == unknown) {
+            const bool reference = lattice_visible(2 * rx + 1, 2 * ry + 1, probe);
+            bool uniform = true;
+            for (int ly = 2 * ry; ly <= 2 * ry + 2 && uniform; ++ly) {
+                for (int lx = 2 * rx; lx <= 2 * rx + 2 && uniform; ++lx) {
+                    uniform = lattice_visible(lx, ly, probe) == reference;
+                }
+            }
+            state = !uniform ? boundary : (reference ? uniform_visible : uniform_occluded);
+        }
+
+        if (state == boundary) return exact(x, y, probe);
+        ++reused;
+        return state == uniform_visible;
+    }
+
+    uint64_t probes = 0; // shadow rays traced
+    uint64_t reused = 0; // tests answered by a region without tracing
+
+private:
+    static const int lattice = 2 * regions + 1;
+    enum State : unsigned char { unknown, uniform_visible, uniform_occluded, boundary };
+    enum Point : unsigned char { point_unknown, point_visible, point_occluded };
+
+    bool enabled;
+    State regions_state[regions * regions] = {};
+    Point points[lattice * lattice] = {};
+
+    static inline int region_index(const double t) {
+        return std::min(std::max(static_cast<int>((t + 1.0) * 0.5 * regions), 0), regions - 1);
+    }
+
+    template<typename Probe>
+    inline bool exact(const double x, const double y, Probe &probe) {
+        ++probes;
+        return probe(x, y);
+    }
+
+    // lattice point (lx, ly), every half region, pulled radially inside the aperture when it falls outside of it
+    template<typename Probe>
+    inline bool lattice_visible(const int lx, const int ly, Probe &probe) {
+        Point &point = points[ly * lattice + lx];
+        if (point == point_unknown) {
+            double x = -1.0 + static_cast<double>(lx) / regions;
+            double y = -1.0 + static_cast<double>(ly) / regions;
+            const double radius = std::sqrt(x*x + y*y);
+            const double max_radius = 0.999; // just inside the rim, the edge itself is a visibility boundary of its own
+            if (radius > max_radius) {
+                x *= max_radius / radius;
+                y *= max_radius / radius;
+            }
+            point = exact(x, y, probe) ? point_visible : point_occluded;
+        }
+        return point == point_visible;
+    }
+};
+
+
+// shadow ray totals of the redistribution over a frame, for the render stats
+class VisibilityStats {
+public:
+    void reset() {
+        probes.store(0);
+        reused.store(0);
+    }
+
+    void add(const ApertureVisibilityCache &cache) {
+        probes.fetch_add(cache.probes, std::memory_order_relaxed);
+        reused.fetch_add(cache.reused, std::memory_order_relaxed);
+    }
+
+    void report() const {
+        const uint64_t traced = probes.load();
+        const uint64_t total = traced + reused.load();
+        if (total == 0) return;
+        AiMsgInfo("[LENTIL BIDIRECTIONAL] shadow rays: %.2fM traced, %.2fM visibility tests answered by the aperture cache (%.1f%%)",
+                  traced * 1e-6, reused.load() * 1e-6, 100.0 * reused.load() / total);
+    }
+
+private:
+    std::atomic<uint64_t> probes{0};
+    std::atomic<uint64_t> reused{0};
+};